@@ -16,6 +16,7 @@
 #include <unistd.h>
 
 #include "fonts/chicago12.h"
+#include "kdraw.h"
 
 /* Base dimensions (unscaled) */
 #define BASE_BAR_HEIGHT 24
@@ -75,42 +76,11 @@ static Atom wm_state;
 
 /* Drawing primitives */
 static void bar_rect(int x, int y, int w, int h, uint32_t c) {
-    for (int row = 0; row < h; row++) {
-        for (int col = 0; col < w; col++) {
-            int px = x + col;
-            int py = y + row;
-            if (px >= 0 && px < screen_width && py >= 0 && py < bar_height) {
-                buf[py * screen_width + px] = c;
-            }
-        }
-    }
-}
-
-static void draw_icn(char *sprite, int x, int y, int scale, uint32_t color) {
-    for (int dy = 0; dy < 8; dy++) {
-        for (int dx = 0; dx < 8; dx++) {
-            if (*(sprite + dy) << dx & 0x80) {
-                bar_rect(x + dx * scale, y + dy * scale, scale, scale, color);
-            }
-        }
-    }
+    kd_fill_rect(buf, screen_width, bar_height, x, y, w, h, c);
 }
 
 static void bar_text(unsigned char *font, int x, int y, char *s, int scale, uint32_t c) {
-    while (*s) {
-        char chr = *s++;
-        int size = font[(unsigned char)chr];
-        if (chr > 32) {
-            char *sprite = (char *)&font[(unsigned char)chr * 8 * 4 + 256];
-            draw_icn(sprite, x, y, scale, c);
-            draw_icn(sprite + 8, x, y + 8 * scale, scale, c);
-            if (size > 8) {
-                draw_icn(sprite + 16, x + 8 * scale, y, scale, c);
-                draw_icn(sprite + 24, x + 8 * scale, y + 8 * scale, scale, c);
-            }
-        }
-        x = x + size * scale;
-    }
+    kd_text(buf, screen_width, bar_height, font, x, y, s, scale, c);
 }
 
 /* Calculate text width */
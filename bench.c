@@ -0,0 +1,326 @@
+/*
+ * kbench - headless VTE/screen benchmark
+ *
+ * Replays canned PTY byte streams through tsm_vte_input() and renders the
+ * resulting screen with tsm_screen_draw(), without any window system. Every
+ * run uses the same deterministic streams so numbers can be compared across
+ * commits.
+ *
+ * Usage: kbench [MB per case] [case name]
+ *
+ * Reported per case:
+ *   MB/s        input throughput of tsm_vte_input()
+ *   allocs/MB   heap allocations (malloc/calloc/realloc) per MB of input,
+ *               with the scrollback buffer already full
+ *   draw ns     tsm_screen_draw() cost per cell with a no-op callback
+ *   paint ns    same, with a callback filling pixels cell by cell
+ *   runs ns     tsm_screen_draw_runs() filling the same pixels run by run,
+ *               the way kterm draws
+ *
+ * Allocations are counted by wrapping the libc allocator at link time
+ * (-Wl,--wrap), see the bench target in the makefile.
+ */
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kdraw.h"
+#include "fonts/terminus16.h"
+#include "tsm/libtsm.h"
+
+#define COLS 120
+#define ROWS 40
+#define CHAR_W 9
+#define CHAR_H 16
+#define CHUNK 4096
+#define STREAM_SIZE (1024 * 1024)
+#define DRAW_FRAMES 200
+#define SB_LINES 1000 /* small enough for the warm-up to fill it */
+
+/* ============================================================================
+ * ALLOCATION COUNTING
+ * ============================================================================ */
+
+static unsigned long allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  allocs++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocs++;
+  return __real_realloc(p, size);
+}
+
+/* ============================================================================
+ * CANNED STREAMS
+ * ============================================================================ */
+
+typedef struct {
+  char *data;
+  size_t len, cap;
+} stream;
+
+static uint32_t rng = 1;
+
+static uint32_t rnd(uint32_t n) {
+  rng = rng * 1103515245 + 12345;
+  return (rng >> 8) % n;
+}
+
+static void put(stream *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void put(stream *s, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(s->data + s->len, s->cap - s->len, fmt, ap);
+  va_end(ap);
+  if (n > 0 && s->len + n < s->cap) s->len += n;
+  else s->len = s->cap;
+}
+
+static void put_word(stream *s) {
+  int n = 1 + rnd(10);
+  for (int i = 0; i < n && s->len < s->cap; i++) {
+    s->data[s->len++] = 'a' + rnd(26);
+  }
+}
+
+/* Compiler output, logs: printable ASCII lines of varying length */
+static void gen_ascii(stream *s) {
+  while (s->len + 256 < s->cap) {
+    int n = rnd(COLS);
+    for (int i = 0; i < n; i++) s->data[s->len++] = 32 + rnd(95);
+    put(s, "\r\n");
+  }
+}
+
+/* ls --color, syntax highlighters: a colour change every word */
+static void gen_sgr(stream *s) {
+  while (s->len + 256 < s->cap) {
+    for (int w = 0; w < 10; w++) {
+      switch (rnd(4)) {
+      case 0: put(s, "\033[%dm", 30 + rnd(8)); break;
+      case 1: put(s, "\033[1;38;5;%dm", rnd(256)); break;
+      case 2: put(s, "\033[38;2;%d;%d;%dm", rnd(256), rnd(256), rnd(256)); break;
+      default: put(s, "\033[0m"); break;
+      }
+      put_word(s);
+      put(s, " ");
+    }
+    put(s, "\033[0m\r\n");
+  }
+}
+
+/* htop, vim: cursor-addressed updates of a full screen, never scrolling */
+static void gen_tui(stream *s) {
+  while (s->len + 1024 < s->cap) {
+    put(s, "\033[H\033[7m");
+    for (int i = 0; i < COLS; i++) put(s, " ");
+    put(s, "\033[0m");
+    for (int i = 0; i < 8; i++) {
+      put(s, "\033[%d;%dH\033[3%dm", 2 + rnd(ROWS - 1), 1 + rnd(COLS - 20), rnd(8));
+      put_word(s);
+      put(s, "\033[K");
+    }
+    put(s, "\033[%d;1H\033[2K\033[0m-- INSERT --", ROWS);
+  }
+}
+
+/* cat of a large file: short lines, every byte pair scrolls the screen */
+static void gen_scroll(stream *s) {
+  while (s->len + 256 < s->cap) {
+    int n = rnd(8);
+    for (int i = 0; i < n; i++) s->data[s->len++] = 'a' + rnd(26);
+    put(s, "\n");
+  }
+}
+
+/* CJK text with combining marks and box drawing */
+static void gen_unicode(stream *s) {
+  static const char *glyphs[] = {
+    "\xe4\xb8\xad", "\xe6\x96\x87", "\xe6\xbc\xa2", "\xe5\xad\x97",  /* wide */
+    "e\xcc\x81", "a\xcc\x88", "n\xcc\x83",                           /* combining */
+    "\xe2\x94\x80", "\xe2\x94\x82", "\xe2\x94\x8c",                  /* box */
+    "\xc3\xa9", "\xce\xbb", "\xf0\x9f\x98\x80",                      /* misc */
+  };
+  while (s->len + 256 < s->cap) {
+    int n = rnd(50);
+    for (int i = 0; i < n; i++) put(s, "%s", glyphs[rnd(sizeof(glyphs) / sizeof(glyphs[0]))]);
+    put(s, "\r\n");
+  }
+}
+
+typedef struct {
+  const char *name;
+  void (*gen)(stream *s);
+} bench_case;
+
+static const bench_case cases[] = {
+  { "ascii",   gen_ascii },
+  { "sgr",     gen_sgr },
+  { "tui",     gen_tui },
+  { "scroll",  gen_scroll },
+  { "unicode", gen_unicode },
+};
+
+/* ============================================================================
+ * DRAW CALLBACKS
+ * ============================================================================ */
+
+static uint32_t pixels[COLS * CHAR_W * ROWS * CHAR_H];
+
+static int noop_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch,
+                   size_t len, unsigned int width, unsigned int posx,
+                   unsigned int posy, const struct tsm_screen_attr *attr,
+                   tsm_age_t age, void *data) {
+  (void)con; (void)id; (void)ch; (void)len; (void)width;
+  (void)posx; (void)posy; (void)attr; (void)age; (void)data;
+  return 0;
+}
+
+/* Background fill plus glyph blit, the same work kterm's draw_cb does */
+static int paint_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch,
+                    size_t len, unsigned int width, unsigned int posx,
+                    unsigned int posy, const struct tsm_screen_attr *attr,
+                    tsm_age_t age, void *data) {
+  (void)con; (void)id; (void)width; (void)age; (void)data;
+  const int bw = COLS * CHAR_W, bh = ROWS * CHAR_H;
+  int x = posx * CHAR_W, y = posy * CHAR_H;
+  uint32_t fg = (attr->fr << 16) | (attr->fg << 8) | attr->fb;
+  uint32_t bg = (attr->br << 16) | (attr->bg << 8) | attr->bb;
+  if (attr->inverse) {
+    uint32_t tmp = fg;
+    fg = bg;
+    bg = tmp;
+  }
+
+  kd_fill_rect(pixels, bw, bh, x, y, CHAR_W, CHAR_H, bg);
+  if (len > 0 && ch[0] < 128) {
+    kd_glyph_blit(pixels, bw, bh, kd_glyph_get(terminus, ch[0], 1), x, y, fg);
+  }
+  return 0;
+}
+
+/* One background span per run, glyphs only for non-blank runs */
+static int paint_run_cb(struct tsm_screen *con, const struct tsm_screen_run *run,
+                        void *data) {
+  (void)con; (void)data;
+  const int bw = COLS * CHAR_W, bh = ROWS * CHAR_H;
+  int x = run->posx * CHAR_W, y = run->posy * CHAR_H;
+  int w = run->cells * CHAR_W;
+
+  kd_fill_rect(pixels, bw, bh, x, y, w, CHAR_H, run->bg);
+  if (run->blank) return 0;
+  for (unsigned int i = 0; i < run->cells; i++) {
+    uint32_t c = run->ch[i];
+    if (c && c < 128) {
+      kd_glyph_blit(pixels, bw, bh, kd_glyph_get(terminus, c, 1),
+                    x + i * CHAR_W, y, run->fg);
+    }
+  }
+  return 0;
+}
+
+/* ============================================================================
+ * MAIN
+ * ============================================================================ */
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void vte_write_cb(struct tsm_vte *vte, const char *u8, size_t len, void *data) {
+  (void)vte; (void)u8; (void)len; (void)data;
+}
+
+static double bench_draw(struct tsm_screen *screen, tsm_screen_draw_cb cb) {
+  double t = now();
+  for (int i = 0; i < DRAW_FRAMES; i++) tsm_screen_draw(screen, cb, NULL);
+  return (now() - t) * 1e9 / ((double)DRAW_FRAMES * COLS * ROWS);
+}
+
+static double bench_runs(struct tsm_screen *screen, tsm_screen_draw_run_cb cb) {
+  double t = now();
+  for (int i = 0; i < DRAW_FRAMES; i++) tsm_screen_draw_runs(screen, cb, NULL);
+  return (now() - t) * 1e9 / ((double)DRAW_FRAMES * COLS * ROWS);
+}
+
+static void run_case(const bench_case *bc, size_t total) {
+  struct tsm_screen *screen;
+  struct tsm_vte *vte;
+  stream s = { malloc(STREAM_SIZE), 0, STREAM_SIZE };
+
+  rng = 1;
+  bc->gen(&s);
+
+  if (tsm_screen_new(&screen, NULL, NULL) < 0 ||
+      tsm_vte_new(&vte, screen, vte_write_cb, NULL, NULL, NULL) < 0) {
+    fprintf(stderr, "kbench: cannot create screen\n");
+    exit(1);
+  }
+  tsm_screen_resize(screen, COLS, ROWS);
+  tsm_screen_set_max_sb(screen, SB_LINES);
+
+  /* Warm up once so one-time allocations (style table, line pool, glyph
+   * cache) do not count against the steady state. Every stream that
+   * scrolls has far more than SB_LINES lines, so the scrollback is full
+   * afterwards and the measured loop recycles evicted lines and their
+   * packed buffers instead of growing the scrollback. */
+  tsm_vte_input(vte, s.data, s.len);
+  tsm_screen_draw(screen, paint_cb, NULL);
+
+  size_t fed = 0;
+  unsigned long a = allocs;
+  double t = now();
+  while (fed < total) {
+    for (size_t off = 0; off < s.len && fed < total; off += CHUNK) {
+      size_t n = s.len - off < CHUNK ? s.len - off : CHUNK;
+      tsm_vte_input(vte, s.data + off, n);
+      fed += n;
+    }
+  }
+  t = now() - t;
+  double mb = fed / 1e6;
+  a = allocs - a;
+
+  double draw = bench_draw(screen, noop_cb);
+  double paint = bench_draw(screen, paint_cb);
+  double runs = bench_runs(screen, paint_run_cb);
+
+  printf("%-8s %9.1f %11.1f %9.2f %9.2f %9.2f\n", bc->name, mb / t, a / mb, draw,
+         paint, runs);
+
+  tsm_vte_unref(vte);
+  tsm_screen_unref(screen);
+  free(s.data);
+}
+
+int main(int argc, char **argv) {
+  size_t total = (argc > 1 ? atoi(argv[1]) : 16) * (size_t)1000000;
+  const char *only = argc > 2 ? argv[2] : NULL;
+
+  printf("%-8s %9s %11s %9s %9s %9s\n", "case", "MB/s", "allocs/MB", "draw ns",
+         "paint ns", "runs ns");
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (only && strcmp(only, cases[i].name)) continue;
+    run_case(&cases[i], total);
+  }
+  return 0;
+}
@@ -207,6 +207,7 @@ static void handle_button(Button *b) {
 
 static void handle_key(int k, int mod, void *userdata) {
   (void)userdata;
+  kg_invalidate(&ctx);
   (void)mod;
 
   if (k == 'q' || k == 'Q' || k == KG_KEY_ESCAPE) {
@@ -258,7 +259,7 @@ static void draw(void) {
   int h = f->height;
 
   /* Clear background */
-  for (int i = 0; i < w * h; i++) f->buf[i] = BG_COLOR;
+  kd_span_fill(f->buf, w * h, BG_COLOR);
 
   /* Draw display area */
   int display_padding = KG_SCALED(8, ctx.scale);
@@ -369,10 +370,12 @@ static int run(void) {
     }
 
     /* Handle keyboard */
-    kg_key_process(&ctx.key_repeat, f.keys, f.mod, handle_key, NULL);
+    kg_key_process(&ctx.key_repeat, &f, handle_key, NULL);
 
-    draw();
-    ctx.f->dirty = true;
+    if (kg_frame_ready(&ctx)) {
+      draw();
+      ctx.f->dirty = true;
+    }
 
     kg_frame_end(&ctx);
   }
@@ -14,18 +14,44 @@
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
 #include <X11/extensions/XShm.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/shm.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 #endif
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "kdraw.h"
+
+#ifndef FENSTER_MAX_DAMAGE
+#define FENSTER_MAX_DAMAGE 16
+#endif
+#ifndef FENSTER_MAX_EVENTS
+#define FENSTER_MAX_EVENTS 64
+#endif
+
+struct fenster_box {
+  int x, y, w, h;
+};
+
+struct fenster_event {
+  int key;      /* keys[] index */
+  int down;     /* 1 on press, 0 on release */
+  int mod;      /* mod at the time of the event */
+  int64_t time; /* fenster_time() clock, from the X server timestamp on X11 */
+};
+
 struct fenster {
   const char *title;
   bool size_changed;
   bool dirty; /* set to true when buffer needs to be redrawn to screen */
+  int ndamage; /* partial redraws collected by fenster_damage() */
+  struct fenster_box damage[FENSTER_MAX_DAMAGE];
   int width;
   int height;
   uint32_t *buf;
@@ -35,6 +61,13 @@ struct fenster {
   int y;
   int mouse;
   int scroll; /* scroll wheel: -1 down, 0 none, +1 up (X11 only for now) */
+  unsigned int buf_id; /* changes whenever buf is reallocated and loses its contents */
+  int64_t frame_time;  /* fenster_time() when the last frame was presented */
+  int frame_ms;        /* how long the server took to present it, 0 if unknown */
+  /* Key presses and releases in arrival order, read with fenster_event().
+   * Unlike keys[] nothing is lost when both happen within one frame. */
+  struct fenster_event events[FENSTER_MAX_EVENTS];
+  unsigned int ev_head, ev_tail;
 #if defined(__APPLE__)
   id wnd;
 #elif defined(_WIN32)
@@ -43,9 +76,31 @@ struct fenster {
   Display *dpy;
   Window w;
   GC gc;
-  XImage *img;
-  XShmSegmentInfo shminfo;
+  uint8_t keymap[256];   /* keycode -> keys[] index, 0 if unmapped */
+  int64_t time_offset;   /* fenster_time() minus X server time */
+  XImage *img; /* image of buf */
   bool use_shm;
+  uint32_t *img_buf; /* buf when not using SHM */
+  size_t img_size;   /* pixels allocated in img_buf */
+  /* SHM images are double-buffered: buf is the back image and drawing goes
+   * on while the server still reads the front one */
+  XImage *shm_img[2];
+  XShmSegmentInfo shm_info[2];
+  size_t shm_size[2];  /* bytes in each segment, kept when shrinking */
+  bool shm_busy[2];    /* put sent, completion not yet received */
+  int64_t shm_sent[2];
+  int shm_count, shm_back;
+  int shm_completion;  /* event type of ShmCompletion */
+  struct {
+    bool on;         /* no X connection, frames go to memory only */
+    FILE *script;    /* input script, one command per frame */
+    int64_t wait;    /* no commands are read before this time (us) */
+    int timer;       /* timerfd that fires when the wait is over */
+    int release;     /* key pressed by "key", released next frame */
+    int frames;
+    const char *dump; /* write every presented frame to <dump>NNNNN.ppm */
+    int64_t t_loop, t_app, t_present; /* microseconds */
+  } headless;
 #endif
 };
 
@@ -57,9 +112,17 @@ FENSTER_API int fenster_loop(struct fenster *f);
 FENSTER_API void fenster_close(struct fenster *f);
 FENSTER_API void fenster_sleep(int64_t ms);
 FENSTER_API int64_t fenster_time(void);
+FENSTER_API void fenster_damage(struct fenster *f, int x, int y, int w, int h);
+FENSTER_API int fenster_event(struct fenster *f, struct fenster_event *ev);
+#if !defined(__APPLE__) && !defined(_WIN32)
+FENSTER_API int fenster_fd(struct fenster *f);
+FENSTER_API int fenster_pending(struct fenster *f);
+#endif
 #define fenster_pixel(f, x, y) ((f)->buf[((y) * (f)->width) + (x)])
 
 #ifndef FENSTER_HEADER
+static void fenster_push_key(struct fenster *f, int key, int down, int64_t time);
+
 #if defined(__APPLE__)
 #define msg(r, o, s) ((r(*)(id, SEL))objc_msgSend)(o, sel_getUid(s))
 #define msg1(r, o, s, A, a)                                                    \
@@ -141,6 +204,7 @@ static const uint8_t FENSTER_KEYCODES[128] = {65,83,68,70,72,71,90,88,67,86,0,66
 // clang-format on
 FENSTER_API int fenster_loop(struct fenster *f) {
   msg1(void, msg(id, f->wnd, "contentView"), "setNeedsDisplay:", BOOL, YES);
+  f->ndamage = 0;
   id ev = msg4(id, NSApp,
                "nextEventMatchingMask:untilDate:inMode:dequeue:", NSUInteger,
                NSUIntegerMax, id, NULL, id, NSDefaultRunLoopMode, BOOL, YES);
@@ -164,9 +228,12 @@ FENSTER_API int fenster_loop(struct fenster *f) {
   case 10: /*NSEventTypeKeyDown*/
   case 11: /*NSEventTypeKeyUp:*/ {
     NSUInteger k = msg(NSUInteger, ev, "keyCode");
-    f->keys[k < 127 ? FENSTER_KEYCODES[k] : 0] = evtype == 10;
+    int key = k < 127 ? FENSTER_KEYCODES[k] : 0, down = evtype == 10;
+    int repeat = down && f->keys[key]; /* auto-repeat */
+    f->keys[key] = down;
     NSUInteger mod = msg(NSUInteger, ev, "modifierFlags") >> 17;
     f->mod = (mod & 0xc) | ((mod & 1) << 1) | ((mod >> 1) & 1);
+    if (key && !repeat) fenster_push_key(f, key, down, fenster_time());
     return 0;
   }
   }
@@ -219,7 +286,11 @@ static LRESULT CALLBACK fenster_wndproc(HWND hwnd, UINT msg, WPARAM wParam,
              ((GetKeyState(VK_SHIFT) & 0x8000) >> 14) |
              ((GetKeyState(VK_MENU) & 0x8000) >> 13) |
              (((GetKeyState(VK_LWIN) | GetKeyState(VK_RWIN)) & 0x8000) >> 12);
-    f->keys[FENSTER_KEYCODES[HIWORD(lParam) & 0x1ff]] = !((lParam >> 31) & 1);
+    int k = FENSTER_KEYCODES[HIWORD(lParam) & 0x1ff];
+    int down = !((lParam >> 31) & 1);
+    int repeat = down && f->keys[k]; /* auto-repeat */
+    f->keys[k] = down;
+    if (k && !repeat) fenster_push_key(f, k, down, fenster_time());
   } break;
   case WM_DESTROY:
     PostQuitMessage(0);
@@ -262,12 +333,41 @@ FENSTER_API int fenster_loop(struct fenster *f) {
     DispatchMessage(&msg);
   }
   InvalidateRect(f->hwnd, NULL, TRUE);
+  f->ndamage = 0;
   return 0;
 }
 #else
 // clang-format off
 static int FENSTER_KEYCODES[124] = {XK_BackSpace,8,XK_Delete,127,XK_Down,18,XK_End,5,XK_Escape,27,XK_Home,2,XK_Insert,26,XK_Left,20,XK_Page_Down,4,XK_Page_Up,3,XK_Return,10,XK_Right,19,XK_Tab,9,XK_Up,17,XK_apostrophe,39,XK_backslash,92,XK_bracketleft,91,XK_bracketright,93,XK_comma,44,XK_equal,61,XK_grave,96,XK_minus,45,XK_period,46,XK_semicolon,59,XK_slash,47,XK_space,32,XK_a,65,XK_b,66,XK_c,67,XK_d,68,XK_e,69,XK_f,70,XK_g,71,XK_h,72,XK_i,73,XK_j,74,XK_k,75,XK_l,76,XK_m,77,XK_n,78,XK_o,79,XK_p,80,XK_q,81,XK_r,82,XK_s,83,XK_t,84,XK_u,85,XK_v,86,XK_w,87,XK_x,88,XK_y,89,XK_z,90,XK_0,48,XK_1,49,XK_2,50,XK_3,51,XK_4,52,XK_5,53,XK_6,54,XK_7,55,XK_8,56,XK_9,57};
 // clang-format on
+
+/* Resolve every keycode through FENSTER_KEYCODES once, so key events are a
+ * table lookup. Rebuilt when the keyboard mapping changes. */
+static void fenster_build_keymap(struct fenster *f) {
+  int min, max;
+  XDisplayKeycodes(f->dpy, &min, &max);
+  memset(f->keymap, 0, sizeof(f->keymap));
+  for (int kc = min; kc <= max && kc < 256; kc++) {
+    KeySym k = XkbKeycodeToKeysym(f->dpy, kc, 0, 0);
+    for (unsigned int i = 0; i < 124; i += 2) {
+      if (FENSTER_KEYCODES[i] == (int)k) {
+        f->keymap[kc] = FENSTER_KEYCODES[i + 1];
+        break;
+      }
+    }
+  }
+}
+
+/* Map an X server timestamp onto the fenster_time() clock. Events are never
+ * delivered before they happen, so the smallest offset seen is the best
+ * estimate; a jump of half the 32-bit range means the server time wrapped. */
+static int64_t fenster_x_time(struct fenster *f, Time t) {
+  int64_t off = fenster_time() - (int64_t)t;
+  if (!f->time_offset || off < f->time_offset || off - f->time_offset > 0x7fffffff)
+    f->time_offset = off;
+  return (int64_t)t + f->time_offset;
+}
+
 static int fenster_shm_error = 0;
 static int fenster_shm_handler(Display *dpy, XErrorEvent *ev) {
   (void)dpy; (void)ev;
@@ -275,58 +375,387 @@ static int fenster_shm_handler(Display *dpy, XErrorEvent *ev) {
   return 0;
 }
 
-static void fenster_create_shm_image(struct fenster *f) {
-  f->use_shm = false;
-  if (!XShmQueryExtension(f->dpy)) return;
-  
-  f->img = XShmCreateImage(f->dpy, DefaultVisual(f->dpy, 0), 24, ZPixmap, NULL,
-                           &f->shminfo, f->width, f->height);
-  if (!f->img) return;
-  
-  f->shminfo.shmid = shmget(IPC_PRIVATE, f->img->bytes_per_line * f->img->height,
-                            IPC_CREAT | 0777);
-  if (f->shminfo.shmid < 0) {
-    XDestroyImage(f->img);
-    f->img = NULL;
-    return;
+static void fenster_shm_done(struct fenster *f, XShmCompletionEvent *ev) {
+  for (int i = 0; i < f->shm_count; i++) {
+    if (f->shm_busy[i] && ev->shmseg == f->shm_info[i].shmseg) {
+      f->shm_busy[i] = false;
+      f->frame_time = fenster_time();
+      f->frame_ms = (int)(f->frame_time - f->shm_sent[i]);
+    }
   }
-  
-  f->shminfo.shmaddr = f->img->data = shmat(f->shminfo.shmid, NULL, 0);
-  if (f->shminfo.shmaddr == (char *)-1) {
-    shmctl(f->shminfo.shmid, IPC_RMID, NULL);
-    XDestroyImage(f->img);
-    f->img = NULL;
-    return;
+}
+
+static Bool fenster_is_shm_done(Display *dpy, XEvent *ev, XPointer arg) {
+  (void)dpy;
+  return ev->type == ((struct fenster *)arg)->shm_completion;
+}
+
+/* Block until the server has finished reading image i, leaving every
+ * other event queued for fenster_loop() */
+static void fenster_shm_wait(struct fenster *f, int i) {
+  XEvent ev;
+  while (f->shm_busy[i]) {
+    XIfEvent(f->dpy, &ev, fenster_is_shm_done, (XPointer)f);
+    fenster_shm_done(f, (XShmCompletionEvent *)&ev);
   }
-  f->shminfo.readOnly = False;
-  
+}
+
+/* Attach a new segment of size bytes as shm_info[i] */
+static bool fenster_shm_attach(struct fenster *f, int i, size_t size) {
+  XShmSegmentInfo *info = &f->shm_info[i];
+  info->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0777);
+  if (info->shmid < 0) return false;
+
+  info->shmaddr = shmat(info->shmid, NULL, 0);
+  if (info->shmaddr == (char *)-1) {
+    shmctl(info->shmid, IPC_RMID, NULL);
+    return false;
+  }
+  info->readOnly = False;
+
   fenster_shm_error = 0;
   XErrorHandler old_handler = XSetErrorHandler(fenster_shm_handler);
-  if (!XShmAttach(f->dpy, &f->shminfo)) {
-    XSetErrorHandler(old_handler);
-    shmdt(f->shminfo.shmaddr);
-    shmctl(f->shminfo.shmid, IPC_RMID, NULL);
-    XDestroyImage(f->img);
-    f->img = NULL;
-    return;
-  }
+  Status ok = XShmAttach(f->dpy, info);
   XSync(f->dpy, False);
   XSetErrorHandler(old_handler);
-  
-  if (fenster_shm_error) {
-    shmdt(f->shminfo.shmaddr);
-    shmctl(f->shminfo.shmid, IPC_RMID, NULL);
-    XDestroyImage(f->img);
-    f->img = NULL;
+  shmctl(info->shmid, IPC_RMID, NULL);
+
+  if (!ok || fenster_shm_error) {
+    shmdt(info->shmaddr);
+    return false;
+  }
+  f->shm_size[i] = size;
+  return true;
+}
+
+static void fenster_shm_free(struct fenster *f, int i) {
+  if (f->shm_size[i]) {
+    XShmDetach(f->dpy, &f->shm_info[i]);
+    shmdt(f->shm_info[i].shmaddr);
+    f->shm_size[i] = 0;
+  }
+  if (f->shm_img[i]) XDestroyImage(f->shm_img[i]);
+  f->shm_img[i] = NULL;
+  f->shm_busy[i] = false;
+}
+
+/*
+ * Fit SHM image i to the window. Segments grow by at least half and are
+ * kept when the window shrinks, so most steps of a drag-resize only
+ * rebuild the client-side XImage header, without any round trip.
+ */
+static bool fenster_shm_image(struct fenster *f, int i) {
+  fenster_shm_wait(f, i);
+  if (f->shm_img[i]) XDestroyImage(f->shm_img[i]);
+  f->shm_img[i] = XShmCreateImage(f->dpy, DefaultVisual(f->dpy, 0), 24, ZPixmap, NULL,
+                                  &f->shm_info[i], f->width, f->height);
+  if (!f->shm_img[i]) return false;
+
+  size_t need = (size_t)f->shm_img[i]->bytes_per_line * f->shm_img[i]->height;
+  if (need > f->shm_size[i]) {
+    size_t size = f->shm_size[i] + f->shm_size[i] / 2;
+    if (size < need) size = need;
+    if (f->shm_size[i]) {
+      XShmDetach(f->dpy, &f->shm_info[i]);
+      shmdt(f->shm_info[i].shmaddr);
+      f->shm_size[i] = 0;
+    }
+    if (!fenster_shm_attach(f, i, size)) return false;
+  }
+  f->shm_img[i]->data = f->shm_info[i].shmaddr;
+  return true;
+}
+
+/*
+ * (Re)create the image(s) behind buf for the current window size. SHM
+ * images are double-buffered; if segments run out this falls back to one
+ * image, then to XPutImage from a heap buffer that grows the same way.
+ * Returns -1 if not even the heap buffer can be had.
+ */
+static int fenster_create_image(struct fenster *f) {
+  if (f->use_shm) {
+    int n = 0;
+    f->img = NULL; /* shm_img[0], rebuilt or freed below */
+    while (n < f->shm_count && fenster_shm_image(f, n)) n++;
+    for (int i = n; i < f->shm_count; i++) fenster_shm_free(f, i);
+    f->shm_count = n;
+    f->shm_back = 0;
+    f->use_shm = n > 0;
+  }
+
+  if (f->use_shm) {
+    f->img = f->shm_img[0];
+  } else {
+    size_t need = (size_t)f->width * f->height;
+    if (need > f->img_size) {
+      size_t size = f->img_size + f->img_size / 2;
+      if (size < need) size = need;
+      uint32_t *buf = (uint32_t *)malloc(size * sizeof(uint32_t));
+      if (!buf) return -1;
+      free(f->img_buf);
+      f->img_buf = buf;
+      f->img_size = size;
+    }
+    if (f->img) {
+      f->img->data = NULL; /* img_buf is ours, not the image's */
+      XDestroyImage(f->img);
+    }
+    f->img = XCreateImage(f->dpy, DefaultVisual(f->dpy, 0), 24, ZPixmap, 0,
+                          (char *)f->img_buf, f->width, f->height, 32, 0);
+    if (!f->img) return -1;
+  }
+  f->buf = (uint32_t *)f->img->data;
+  f->buf_id++;
+  return 0;
+}
+
+/*
+ * Send the damaged parts of the back image and flip: drawing continues in
+ * the other image as soon as the server is done with its previous frame,
+ * so a frame is never overwritten while it is being read. The damage is
+ * copied over first, keeping both images identical after every flip and
+ * buf contents valid for apps that only redraw what changed.
+ */
+static void fenster_shm_present(struct fenster *f) {
+  int back = f->shm_back;
+  for (int i = 0; i < f->ndamage; i++) {
+    struct fenster_box *r = &f->damage[i];
+    XShmPutImage(f->dpy, f->w, f->gc, f->shm_img[back], r->x, r->y, r->x, r->y,
+                 r->w, r->h, i == f->ndamage - 1);
+  }
+  f->shm_busy[back] = true;
+  f->shm_sent[back] = fenster_time();
+  XFlush(f->dpy);
+  if (f->shm_count < 2) {
+    fenster_shm_wait(f, back);
     return;
   }
-  
-  shmctl(f->shminfo.shmid, IPC_RMID, NULL);
+
+  int next = !back;
+  fenster_shm_wait(f, next);
+  int stride = f->shm_img[back]->bytes_per_line;
+  for (int i = 0; i < f->ndamage; i++) {
+    struct fenster_box *r = &f->damage[i];
+    for (int y = r->y; y < r->y + r->h; y++) {
+      size_t off = (size_t)y * stride + (size_t)r->x * 4;
+      memcpy(f->shm_img[next]->data + off, f->shm_img[back]->data + off, (size_t)r->w * 4);
+    }
+  }
+  f->shm_back = next;
+  f->img = f->shm_img[next];
   f->buf = (uint32_t *)f->img->data;
-  f->use_shm = true;
+}
+
+/*
+ * Headless backend
+ *
+ * Selected by setting FENSTER_HEADLESS in the environment, or by building
+ * with -DFENSTER_HEADLESS. No X connection is made: frames are rendered into
+ * a heap buffer, input comes from the script named by FENSTER_SCRIPT and each
+ * presented frame can be written to FENSTER_DUMP<frame>.ppm. Script lines
+ * (blank lines and # comments are skipped) are run one per fenster_loop():
+ *
+ *   key K        press K for one frame (K is a character, a key code or
+ *                Return/Tab/Backspace/Escape/Delete/Up/Down/Left/Right/
+ *                Home/End/PageUp/PageDown/Insert/Space)
+ *   down K, up K press or release K
+ *   mod M        set the modifier mask (ctrl=1 shift=2 alt=4 meta=8)
+ *   move X Y     move the pointer
+ *   mouse 0|1    release or press the mouse button
+ *   scroll N     scroll wheel, +1 up -1 down
+ *   resize W H   resize the window
+ *   wait MS      no input for MS milliseconds
+ *   dump PATH    write the current frame to PATH as PPM
+ *   quit         make fenster_loop() fail, ending the program
+ *
+ * The end of the script acts as quit. Frame timings are printed to stderr
+ * by fenster_close().
+ */
+static int64_t fenster_headless_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int fenster_headless_key(const char *name) {
+  static const struct { const char *name; int key; } names[] = {
+    {"Return", 10}, {"Tab", 9}, {"Backspace", 8}, {"Escape", 27},
+    {"Delete", 127}, {"Up", 17}, {"Down", 18}, {"Right", 19}, {"Left", 20},
+    {"Home", 2}, {"End", 5}, {"PageUp", 3}, {"PageDown", 4}, {"Insert", 26},
+    {"Space", 32},
+  };
+  for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (!strcmp(name, names[i].name)) return names[i].key;
+  }
+  if (name[0] && !name[1]) {
+    /* keys[] holds letters as upper case, like the X11 keycode table */
+    if (name[0] >= 'a' && name[0] <= 'z') return name[0] - 'a' + 'A';
+    return (unsigned char)name[0];
+  }
+  return atoi(name) & 255;
+}
+
+static void fenster_headless_ppm(struct fenster *f, const char *path) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp) return;
+  fprintf(fp, "P6\n%d %d\n255\n", f->width, f->height);
+  for (int i = 0; i < f->width * f->height; i++) {
+    uint32_t c = f->buf[i];
+    unsigned char rgb[3] = {c >> 16, c >> 8, c};
+    fwrite(rgb, 1, 3, fp);
+  }
+  fclose(fp);
+}
+
+static int fenster_headless_resize(struct fenster *f, int w, int h) {
+  if (w <= 0 || h <= 0) return 0;
+  uint32_t *buf = (uint32_t *)calloc((size_t)w * h, sizeof(uint32_t));
+  if (!buf) return -1;
+  free(f->buf);
+  f->buf = buf;
+  f->width = w;
+  f->height = h;
+  f->buf_id++;
+  f->size_changed = true;
+  f->dirty = true;
+  return 0;
+}
+
+/* Run one script command, returns -1 to end the program */
+static int fenster_headless_step(struct fenster *f) {
+  char line[512], cmd[16], arg[496];
+  int a, b;
+
+  if (f->headless.release) {
+    f->keys[f->headless.release] = 0;
+    fenster_push_key(f, f->headless.release, 0, fenster_time());
+    f->headless.release = 0;
+  }
+  if (fenster_headless_us() < f->headless.wait) return 0;
+  if (!f->headless.script) return 0;
+
+  for (;;) {
+    if (!fgets(line, sizeof(line), f->headless.script)) return -1;
+    line[strcspn(line, "\r\n")] = '\0';
+    arg[0] = '\0';
+    if (sscanf(line, "%15s %495[^\n]", cmd, arg) >= 1 && cmd[0] != '#') break;
+  }
+
+  if (!strcmp(cmd, "key")) {
+    int k = fenster_headless_key(arg);
+    f->keys[k] = 1;
+    fenster_push_key(f, k, 1, fenster_time());
+    f->headless.release = k;
+  } else if (!strcmp(cmd, "down") || !strcmp(cmd, "up")) {
+    int k = fenster_headless_key(arg);
+    f->keys[k] = cmd[0] == 'd';
+    fenster_push_key(f, k, f->keys[k], fenster_time());
+  } else if (!strcmp(cmd, "mod")) {
+    f->mod = atoi(arg);
+  } else if (!strcmp(cmd, "move") && sscanf(arg, "%d %d", &a, &b) == 2) {
+    f->x = a, f->y = b;
+  } else if (!strcmp(cmd, "mouse")) {
+    f->mouse = atoi(arg);
+  } else if (!strcmp(cmd, "scroll")) {
+    f->scroll = atoi(arg);
+  } else if (!strcmp(cmd, "resize") && sscanf(arg, "%d %d", &a, &b) == 2) {
+    return fenster_headless_resize(f, a, b);
+  } else if (!strcmp(cmd, "wait")) {
+    int64_t ms = atoi(arg);
+    struct itimerspec its = {0};
+    f->headless.wait = fenster_headless_us() + ms * 1000;
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = ms % 1000 * 1000000 + 1;
+    if (f->headless.timer >= 0) timerfd_settime(f->headless.timer, 0, &its, NULL);
+  } else if (!strcmp(cmd, "dump")) {
+    fenster_headless_ppm(f, arg);
+  } else if (!strcmp(cmd, "quit")) {
+    return -1;
+  } else {
+    fprintf(stderr, "fenster: unknown script command: %s\n", line);
+  }
+  return 0;
+}
+
+static int fenster_headless_open(struct fenster *f) {
+  const char *script = getenv("FENSTER_SCRIPT");
+  f->headless.on = true;
+  f->headless.dump = getenv("FENSTER_DUMP");
+  f->headless.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (script && !(f->headless.script = fopen(script, "r"))) {
+    fprintf(stderr, "fenster: cannot open script %s\n", script);
+    return -1;
+  }
+  /* Own the buffer like the SHM path does, so resize can replace it */
+  int w = f->width, h = f->height;
+  f->buf = NULL;
+  if (fenster_headless_resize(f, w, h) < 0) return -1;
+  f->size_changed = false;
+  f->headless.t_loop = fenster_headless_us();
+  return 0;
+}
+
+/* Only passes that present a frame are timed, so the app time is the time
+ * spent producing a frame, not script waits or idle passes. */
+static int fenster_headless_loop(struct fenster *f) {
+  int64_t t = fenster_headless_us();
+
+  if (f->dirty || f->ndamage) {
+    f->headless.t_app += t - f->headless.t_loop;
+    if (f->headless.dump) {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s%05d.ppm", f->headless.dump, f->headless.frames);
+      fenster_headless_ppm(f, path);
+    }
+    f->headless.frames++;
+    f->frame_time = fenster_time();
+    f->headless.t_present += fenster_headless_us() - t;
+  }
+  f->dirty = false;
+  f->ndamage = 0;
+  f->size_changed = false;
+
+  int ret = fenster_headless_step(f);
+  f->headless.t_loop = fenster_headless_us();
+  return ret;
+}
+
+/* Nothing to do until the script's wait is over, unless a tapped key still
+ * has to be released */
+static int fenster_headless_pending(struct fenster *f) {
+  return f->headless.release || f->headless.timer < 0 ||
+         fenster_headless_us() >= f->headless.wait;
+}
+
+static void fenster_headless_close(struct fenster *f) {
+  int n = f->headless.frames ? f->headless.frames : 1;
+  fprintf(stderr, "fenster: %d frames, %.3f ms app, %.3f ms present per frame\n",
+          f->headless.frames, f->headless.t_app / 1000.0 / n,
+          f->headless.t_present / 1000.0 / n);
+  if (f->headless.script) fclose(f->headless.script);
+  if (f->headless.timer >= 0) close(f->headless.timer);
+  free(f->buf);
+  f->buf = NULL;
+}
+
+/* A headless window has no connection, its fd becomes readable when a
+ * script wait is over */
+FENSTER_API int fenster_fd(struct fenster *f) {
+  return f->headless.on ? f->headless.timer : ConnectionNumber(f->dpy);
+}
+
+/* Non-zero if fenster_loop() has input to deliver without blocking. A
+ * headless window is driven by its script and only sleeps through waits. */
+FENSTER_API int fenster_pending(struct fenster *f) {
+  return f->headless.on ? fenster_headless_pending(f) : XPending(f->dpy);
 }
 
 FENSTER_API int fenster_open(struct fenster *f) {
+#ifndef FENSTER_HEADLESS
+  if (getenv("FENSTER_HEADLESS"))
+#endif
+    return fenster_headless_open(f);
+
   f->dpy = XOpenDisplay(NULL);
   int screen = DefaultScreen(f->dpy);
   f->w = XCreateSimpleWindow(f->dpy, RootWindow(f->dpy, screen), 0, 0, f->width,
@@ -337,54 +766,66 @@ FENSTER_API int fenster_open(struct fenster *f) {
   XStoreName(f->dpy, f->w, f->title);
   XMapWindow(f->dpy, f->w);
   XSync(f->dpy, f->w);
+  /* Held keys send presses only, repeats are dropped in fenster_loop() */
+  XkbSetDetectableAutoRepeat(f->dpy, True, NULL);
+  fenster_build_keymap(f);
   
-  fenster_create_shm_image(f);
-  if (!f->use_shm) {
-    f->img = XCreateImage(f->dpy, DefaultVisual(f->dpy, 0), 24, ZPixmap, 0,
-                          (char *)f->buf, f->width, f->height, 32, 0);
+  f->use_shm = XShmQueryExtension(f->dpy);
+  if (f->use_shm) {
+    f->shm_count = 2;
+    f->shm_completion = XShmGetEventBase(f->dpy) + ShmCompletion;
   }
+  if (fenster_create_image(f) < 0) return -1;
   f->dirty = true;
   return 0;
 }
 FENSTER_API void fenster_close(struct fenster *f) {
+  if (f->headless.on) {
+    fenster_headless_close(f);
+    return;
+  }
   if (f->use_shm) {
-    XShmDetach(f->dpy, &f->shminfo);
-    shmdt(f->shminfo.shmaddr);
+    for (int i = 0; i < f->shm_count; i++) fenster_shm_free(f, i);
+  } else if (f->img) {
+    f->img->data = NULL;
+    XDestroyImage(f->img);
   }
-  if (f->img) XDestroyImage(f->img);
+  free(f->img_buf);
   XCloseDisplay(f->dpy);
 }
 FENSTER_API int fenster_loop(struct fenster *f) {
   XEvent ev;
+  if (f->headless.on) return fenster_headless_loop(f);
   if (f->dirty) {
-    if (f->use_shm) {
-      XShmPutImage(f->dpy, f->w, f->gc, f->img, 0, 0, 0, 0, f->width, f->height, False);
-    } else {
-      XPutImage(f->dpy, f->w, f->gc, f->img, 0, 0, 0, 0, f->width, f->height);
+    f->ndamage = 1;
+    f->damage[0] = (struct fenster_box){0, 0, f->width, f->height};
+  }
+  if (f->ndamage && f->use_shm) {
+    fenster_shm_present(f);
+  } else if (f->ndamage) {
+    for (int i = 0; i < f->ndamage; i++) {
+      struct fenster_box *r = &f->damage[i];
+      XPutImage(f->dpy, f->w, f->gc, f->img, r->x, r->y, r->x, r->y, r->w, r->h);
     }
-    f->dirty = false;
+    f->frame_time = fenster_time();
   }
+  f->dirty = false;
+  f->ndamage = 0;
   XFlush(f->dpy);
   while (XPending(f->dpy)) {
     f->size_changed = false;
     XNextEvent(f->dpy, &ev);
     switch (ev.type) {
     case ConfigureNotify:
+      /* A drag-resize queues one per motion, only the last size matters */
+      while (XCheckTypedWindowEvent(f->dpy, f->w, ConfigureNotify, &ev)) {
+      }
+      if (ev.xconfigure.width == f->width && ev.xconfigure.height == f->height)
+        break; /* moved, not resized */
       f->size_changed = true;
       f->width = ev.xconfigure.width;
       f->height = ev.xconfigure.height;
-      if (f->use_shm) {
-        XShmDetach(f->dpy, &f->shminfo);
-        shmdt(f->shminfo.shmaddr);
-        XDestroyImage(f->img);
-        f->img = NULL;
-        fenster_create_shm_image(f);
-      } else {
-        free(f->img);
-        f->buf = (uint32_t*)malloc(f->width * f->height * sizeof(uint32_t));
-        f->img = XCreateImage(f->dpy, DefaultVisual(f->dpy, 0), 24, ZPixmap, 0,
-                              (char *)f->buf, f->width, f->height, 32, 0);
-      }
+      if (fenster_create_image(f) < 0) return -1; /* out of memory */
       f->dirty = true;
       break;
     case ButtonPress: {
@@ -410,21 +851,30 @@ FENSTER_API int fenster_loop(struct fenster *f) {
     case KeyPress:
     case KeyRelease: {
       int m = ev.xkey.state;
-      int k = XkbKeycodeToKeysym(f->dpy, ev.xkey.keycode, 0, 0);
-      for (unsigned int i = 0; i < 124; i += 2) {
-        if (FENSTER_KEYCODES[i] == k) {
-          f->keys[FENSTER_KEYCODES[i + 1]] = (ev.type == KeyPress);
-          break;
-        }
-      }
+      int k = f->keymap[ev.xkey.keycode & 255];
       f->mod = (!!(m & ControlMask)) | (!!(m & ShiftMask) << 1) |
                (!!(m & Mod1Mask) << 2) | (!!(m & Mod4Mask) << 3);
+      if (!k || (ev.type == KeyPress && f->keys[k])) break; /* auto-repeat */
+      f->keys[k] = (ev.type == KeyPress);
+      fenster_push_key(f, k, f->keys[k], fenster_x_time(f, ev.xkey.time));
     } break;
+    case MappingNotify:
+      XRefreshKeyboardMapping(&ev.xmapping);
+      if (ev.xmapping.request != MappingPointer) fenster_build_keymap(f);
+      break;
+    case Expose:
+      /* Buffer contents are still valid, present them again */
+      f->dirty = true;
+      break;
     case FocusOut:
       for (int i = 0; i < 256; i++) f->keys[i] = 0;
       f->mod = 0;
       f->mouse = 0;
       break;
+    default:
+      if (f->use_shm && ev.type == f->shm_completion)
+        fenster_shm_done(f, (XShmCompletionEvent *)&ev);
+      break;
     }
   }
   return 0;
@@ -453,6 +903,66 @@ FENSTER_API int64_t fenster_time(void) {
 }
 #endif
 
+/* Queue a key event for fenster_event(), dropping the oldest when full */
+static void fenster_push_key(struct fenster *f, int key, int down, int64_t time) {
+  if (f->ev_tail - f->ev_head == FENSTER_MAX_EVENTS) f->ev_head++;
+  f->events[f->ev_tail++ % FENSTER_MAX_EVENTS] = (struct fenster_event){key, down, f->mod, time};
+}
+
+/* Take the oldest queued key event, returns 0 when there is none */
+FENSTER_API int fenster_event(struct fenster *f, struct fenster_event *ev) {
+  if (f->ev_head == f->ev_tail) return 0;
+  *ev = f->events[f->ev_head++ % FENSTER_MAX_EVENTS];
+  return 1;
+}
+
+static int fenster_box_area(struct fenster_box a) { return a.w * a.h; }
+
+static struct fenster_box fenster_box_union(struct fenster_box a, struct fenster_box b) {
+  int x0 = a.x < b.x ? a.x : b.x, y0 = a.y < b.y ? a.y : b.y;
+  int x1 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+  int y1 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+  return (struct fenster_box){x0, y0, x1 - x0, y1 - y0};
+}
+
+/*
+ * Mark a region of the buffer as changed so that the next fenster_loop()
+ * only presents the damaged parts instead of the whole window. Rectangles
+ * are merged whenever the union costs no more pixels than the two apart,
+ * and squeezed into the cheapest neighbour once the list is full. Setting
+ * f->dirty still presents the full buffer.
+ */
+FENSTER_API void fenster_damage(struct fenster *f, int x, int y, int w, int h) {
+  if (x < 0) w += x, x = 0;
+  if (y < 0) h += y, y = 0;
+  if (x + w > f->width) w = f->width - x;
+  if (y + h > f->height) h = f->height - y;
+  if (w <= 0 || h <= 0 || f->dirty) return;
+
+  struct fenster_box r = {x, y, w, h};
+  for (int i = 0; i < f->ndamage;) {
+    struct fenster_box u = fenster_box_union(r, f->damage[i]);
+    if (fenster_box_area(u) <= fenster_box_area(r) + fenster_box_area(f->damage[i])) {
+      f->damage[i] = f->damage[--f->ndamage];
+      r = u;
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+  if (f->ndamage == FENSTER_MAX_DAMAGE) {
+    int best = 0, best_cost = -1;
+    for (int i = 0; i < f->ndamage; i++) {
+      int cost = fenster_box_area(fenster_box_union(r, f->damage[i])) -
+                 fenster_box_area(f->damage[i]);
+      if (best_cost < 0 || cost < best_cost) best = i, best_cost = cost;
+    }
+    r = fenster_box_union(r, f->damage[best]);
+    f->damage[best] = f->damage[--f->ndamage];
+  }
+  f->damage[f->ndamage++] = r;
+}
+
 /*
 static void fenster_line(struct fenster *f, int x0, int y0, int x1, int y1, uint32_t c) {
   int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
@@ -477,12 +987,7 @@ static void fenster_line(struct fenster *f, int x0, int y0, int x1, int y1, uint
 */
 
 static void fenster_rect(struct fenster *f, int x, int y, int w, int h, uint32_t c) {
-  for (int row = 0; row < h; row++) {
-    for (int col = 0; col < w; col++) {
-      if (x+col > f->width || y+row > f->height) continue;
-      fenster_pixel(f, x + col, y + row) = c;
-    }
-  }
+  kd_fill_rect(f->buf, f->width, f->height, x, y, w, h, c);
 }
 
 /*
@@ -497,31 +1002,8 @@ static void fenster_circle(struct fenster *f, int x, int y, int r, uint32_t c) {
 }
 */
 
-void draw_icn(struct fenster *f, char *sprite, int x, int y, int scale, uint32_t color) {
-  for (int dy = 0; dy < 8; dy++) {
-    for (int dx = 0; dx < 8; dx++) {
-			if (*(sprite+dy) << dx & 0x80) {
-				fenster_rect(f, x + dx*scale, y + dy*scale, scale, scale, color);
-      }
-    }
-  }
-}
-
 static void fenster_text(struct fenster *f, unsigned char *font, int x, int y, char *s, int scale, uint32_t c) {
-  while (*s) {
-    char chr = *s++;
-    int size = font[(int)chr];
-    if (chr > 32) {
-      char *sprite = (char*)&font[chr*8*4 + 256];
-      draw_icn(f, sprite, x, y, scale, c);
-      draw_icn(f, sprite+8, x, y+8*scale, scale, c);
-      if (size > 8) {
-        draw_icn(f, sprite+16, x+8*scale, y, scale, c);
-        draw_icn(f, sprite+24, x+8*scale, y+8*scale, scale, c);
-      }
-    }
-    x = x + size * scale;
-  }
+  kd_text(f->buf, f->width, f->height, font, x, y, s, scale, c);
 }
 
 #endif /* !FENSTER_HEADER */
@@ -494,6 +494,7 @@ static char map_key(int k, int shift) {
 
 static void handle_key(int k, int mod, void *userdata) {
   (void)userdata;
+  kg_invalidate(&ctx);
   int ctrl = mod & KG_MOD_CTRL;
   int shift = mod & KG_MOD_SHIFT;
 
@@ -666,10 +667,12 @@ static int run(const char *path) {
     }
 
     /* Handle keyboard */
-    kg_key_process(&ctx.key_repeat, f.keys, f.mod, handle_key, NULL);
+    kg_key_process(&ctx.key_repeat, &f, handle_key, NULL);
 
-    draw();
-    ctx.f->dirty = true;
+    if (kg_frame_ready(&ctx)) {
+      draw();
+      ctx.f->dirty = true;
+    }
 
     kg_frame_end(&ctx);
   }
@@ -696,7 +699,8 @@ int main(int argc, char **argv) {
     }
   }
   
-  if (!detached) {
+  /* Headless runs are scripted, keep them attached to the caller */
+  if (!detached && !getenv("FENSTER_HEADLESS")) {
     pid_t pid = fork();
     if (pid < 0) return 1;
     if (pid > 0) return 0;
@@ -0,0 +1,600 @@
+#ifndef KDRAW_H
+#define KDRAW_H
+
+/*
+ * kdraw.h - Software rendering helpers shared by all KSuite programs
+ *
+ * Works on plain 0xRRGGBB framebuffers (pointer, width, height) so it can be
+ * used on top of fenster.h as well as by the Xlib-only programs (kbar, kwm):
+ *   - Glyph cache: UF2 font sprites expanded once per (font, glyph, scale)
+ *   - Bitmap font files: mmapped PSF2 fonts for the rest of Unicode, with
+ *     glyphs expanded on first use into a bounded LRU cache
+ *   - Spans: fill, copy, masked blit and alpha blend of pixel runs, with
+ *     SSE2 inner loops where available and rect wrappers that clip once
+ *   - Masked glyph blit, clipped once per glyph
+ *   - Text drawing built on the UF2 glyph cache and the blit
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* ============================================================================
+ * SPANS
+ * ============================================================================ */
+
+/*
+ * Every rect, background and glyph ends up as horizontal runs of pixels, so
+ * the per-pixel work lives here once. The rect functions clip against the
+ * buffer up front and hand whole rows to the span kernels, which have no
+ * bounds checks left and write four pixels per SSE2 store.
+ */
+
+/* Fill n pixels with c */
+static inline void kd_span_fill(uint32_t *d, int n, uint32_t c) {
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i v = _mm_set1_epi32((int)c);
+    for (; i + 16 <= n; i += 16) {
+        _mm_storeu_si128((__m128i *)(d + i), v);
+        _mm_storeu_si128((__m128i *)(d + i + 4), v);
+        _mm_storeu_si128((__m128i *)(d + i + 8), v);
+        _mm_storeu_si128((__m128i *)(d + i + 12), v);
+    }
+    for (; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i *)(d + i), v);
+#endif
+    for (; i < n; i++) d[i] = c;
+}
+
+/* Set the pixels whose mask byte is non-zero to c. Masks hold 0x00 or 0xff
+ * (see kd_glyph), which lets SSE2 select with plain and/andnot/or. */
+static inline void kd_span_mask(uint32_t *d, const uint8_t *m, int n, uint32_t c) {
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i v = _mm_set1_epi32((int)c);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        uint32_t bits;
+        memcpy(&bits, m + i, 4);
+        if (!bits) continue;
+        __m128i b = _mm_cvtsi32_si128((int)bits);
+        b = _mm_unpacklo_epi8(b, b);
+        b = _mm_unpacklo_epi16(b, b);
+        b = _mm_cmpeq_epi32(b, zero); /* all ones where the mask is clear */
+        __m128i px = _mm_loadu_si128((const __m128i *)(d + i));
+        px = _mm_or_si128(_mm_and_si128(b, px), _mm_andnot_si128(b, v));
+        _mm_storeu_si128((__m128i *)(d + i), px);
+    }
+#endif
+    for (; i < n; i++) {
+        if (m[i]) d[i] = c;
+    }
+}
+
+/* Blend c over n pixels with alpha 0..255, rounding like x*a/255 */
+static inline void kd_span_blend(uint32_t *d, int n, uint32_t c, int alpha) {
+    int i = 0;
+    if (alpha <= 0) return;
+    if (alpha >= 255) {
+        kd_span_fill(d, n, c);
+        return;
+    }
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_set1_epi16((short)alpha);
+    __m128i na = _mm_set1_epi16((short)(255 - alpha));
+    __m128i half = _mm_set1_epi16(128);
+    __m128i src = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32((int)c), zero), a);
+    for (; i + 4 <= n; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *)(d + i));
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+        lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, na), src), half);
+        hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, na), src), half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)(d + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t out = 0;
+        for (int sh = 0; sh < 32; sh += 8) {
+            uint32_t t = ((c >> sh) & 0xff) * alpha +
+                         ((d[i] >> sh) & 0xff) * (255 - alpha) + 128;
+            out |= ((t + (t >> 8)) >> 8) << sh;
+        }
+        d[i] = out;
+    }
+}
+
+/* Clip a rect to a bw x bh buffer. Returns 0 if nothing is left. */
+static inline int kd_clip(int bw, int bh, int *x, int *y, int *w, int *h) {
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*x + *w > bw) *w = bw - *x;
+    if (*y + *h > bh) *h = bh - *y;
+    return *w > 0 && *h > 0;
+}
+
+static inline void kd_fill_rect(uint32_t *buf, int bw, int bh,
+                                int x, int y, int w, int h, uint32_t c) {
+    if (!kd_clip(bw, bh, &x, &y, &w, &h)) return;
+    if (x == 0 && w == bw) {
+        kd_span_fill(buf + (size_t)y * bw, w * h, c);
+        return;
+    }
+    for (int row = y; row < y + h; row++) kd_span_fill(buf + (size_t)row * bw + x, w, c);
+}
+
+static inline void kd_blend_rect(uint32_t *buf, int bw, int bh,
+                                 int x, int y, int w, int h, uint32_t c, int alpha) {
+    if (!kd_clip(bw, bh, &x, &y, &w, &h)) return;
+    for (int row = y; row < y + h; row++)
+        kd_span_blend(buf + (size_t)row * bw + x, w, c, alpha);
+}
+
+/* Copy a w x h block of src (stride sw pixels) to (x, y) */
+static inline void kd_copy_rect(uint32_t *buf, int bw, int bh, int x, int y,
+                                const uint32_t *src, int sw, int w, int h) {
+    int x0 = x, y0 = y;
+    if (!kd_clip(bw, bh, &x, &y, &w, &h)) return;
+    src += (size_t)(y - y0) * sw + (x - x0);
+    for (int row = 0; row < h; row++)
+        memmove(buf + (size_t)(y + row) * bw + x, src + (size_t)row * sw, (size_t)w * 4);
+}
+
+/* ============================================================================
+ * GLYPH CACHE
+ * ============================================================================ */
+
+/*
+ * UF2 fonts hold 256 advance widths followed by 32 bytes per glyph: four 8x8
+ * 1bpp tiles ordered top-left, bottom-left, top-right, bottom-right. The
+ * right-hand tiles are only used by glyphs wider than 8 pixels.
+ *
+ * Walking those bits and emitting one rect per set pixel costs scale^2 writes
+ * plus a bounds check per pixel. Instead each glyph is expanded once into a
+ * byte mask cropped to its ink bounding box, and drawing becomes a clipped
+ * row-by-row masked copy.
+ */
+
+#define KD_GLYPH_FACES 8
+
+typedef struct {
+    uint8_t *mask;  /* w*h coverage, 0x00 or 0xff; NULL for blank glyphs */
+    int x, y;       /* ink box offset from the pen position */
+    int w, h;       /* ink box size */
+    int ready;
+} kd_glyph;
+
+typedef struct {
+    const unsigned char *font;
+    int scale;
+    kd_glyph glyphs[256];
+} kd_face;
+
+static kd_face *kd_faces[KD_GLYPH_FACES];
+static int kd_faces_next = 0;
+
+static inline void kd_face_free(kd_face *face) {
+    if (!face) return;
+    for (int i = 0; i < 256; i++) free(face->glyphs[i].mask);
+    free(face);
+}
+
+static inline kd_face *kd_face_get(const unsigned char *font, int scale) {
+    for (int i = 0; i < KD_GLYPH_FACES; i++) {
+        kd_face *face = kd_faces[i];
+        if (face && face->font == font && face->scale == scale) return face;
+    }
+
+    kd_face *face = calloc(1, sizeof(*face));
+    if (!face) return NULL;
+    face->font = font;
+    face->scale = scale;
+
+    /* Programs use one or two faces, recycle slots round-robin if more */
+    kd_face_free(kd_faces[kd_faces_next]);
+    kd_faces[kd_faces_next] = face;
+    kd_faces_next = (kd_faces_next + 1) % KD_GLYPH_FACES;
+    return face;
+}
+
+static inline void kd_glyph_expand(kd_glyph *g, const unsigned char *font,
+                                   unsigned char chr, int scale) {
+    const unsigned char *sprite = &font[chr * 8 * 4 + 256];
+    int cols = font[chr] > 8 ? 16 : 8;
+    uint16_t rows[16];
+    int x0 = 16, x1 = -1, y0 = 16, y1 = -1;
+
+    for (int r = 0; r < 16; r++) {
+        /* Left tiles are sprite[0..15], right tiles sprite[16..31] */
+        rows[r] = (uint16_t)(sprite[r] << 8);
+        if (cols > 8) rows[r] |= sprite[16 + r];
+        if (!rows[r]) continue;
+        if (r < y0) y0 = r;
+        y1 = r;
+        for (int c = 0; c < cols; c++) {
+            if (rows[r] & (0x8000 >> c)) {
+                if (c < x0) x0 = c;
+                if (c > x1) x1 = c;
+            }
+        }
+    }
+
+    g->ready = 1;
+    if (x1 < 0) return;
+
+    g->x = x0 * scale;
+    g->y = y0 * scale;
+    g->w = (x1 - x0 + 1) * scale;
+    g->h = (y1 - y0 + 1) * scale;
+    g->mask = malloc((size_t)g->w * g->h);
+    if (!g->mask) {
+        g->ready = 0;
+        return;
+    }
+
+    for (int r = y0; r <= y1; r++) {
+        uint8_t *row = g->mask + (size_t)(r - y0) * scale * g->w;
+        for (int c = x0; c <= x1; c++) {
+            uint8_t v = (rows[r] & (0x8000 >> c)) ? 0xff : 0x00;
+            memset(row + (c - x0) * scale, v, scale);
+        }
+        for (int s = 1; s < scale; s++) memcpy(row + s * g->w, row, g->w);
+    }
+}
+
+/* Return the cached glyph for chr, expanding it on first use. NULL for
+ * characters that draw nothing (space, controls and non-ASCII). */
+static inline const kd_glyph *kd_glyph_get(const unsigned char *font,
+                                           unsigned char chr, int scale) {
+    if (chr <= 32 || chr > 127) return NULL;
+    kd_face *face = kd_face_get(font, scale);
+    if (!face) return NULL;
+    kd_glyph *g = &face->glyphs[chr];
+    if (!g->ready) kd_glyph_expand(g, font, chr, scale);
+    return g->mask ? g : NULL;
+}
+
+/* Draw glyph g with its pen position at (x, y) into a bw x bh buffer. */
+static inline void kd_glyph_blit(uint32_t *buf, int bw, int bh,
+                                 const kd_glyph *g, int x, int y, uint32_t c) {
+    if (!g) return;
+    int dx = x + g->x, dy = y + g->y;
+    int sx = 0, sy = 0, w = g->w, h = g->h;
+
+    if (dx < 0) { sx = -dx; w += dx; dx = 0; }
+    if (dy < 0) { sy = -dy; h += dy; dy = 0; }
+    if (dx + w > bw) w = bw - dx;
+    if (dy + h > bh) h = bh - dy;
+    if (w <= 0 || h <= 0) return;
+
+    for (int row = 0; row < h; row++) {
+        kd_span_mask(buf + (size_t)(dy + row) * bw + dx,
+                     g->mask + (size_t)(sy + row) * g->w + sx, w, c);
+    }
+}
+
+/* ============================================================================
+ * BITMAP FONT FILES
+ * ============================================================================ */
+
+#ifndef _WIN32
+
+/*
+ * PSF2 is the Linux console font format (BDF fonts convert to it with
+ * bdf2psf): a 32 byte header, fixed-size 1bpp glyphs with rows padded to a
+ * whole byte, and an optional table listing the code points of each glyph.
+ *
+ * Opening a font only maps the file. The code point map is built on the
+ * first lookup and glyphs are expanded on first use into a cache of
+ * KD_PSF_CACHE entries that evicts the least recently used one, so memory
+ * stays bounded however much of Unicode gets drawn. A hit is a bucket probe
+ * and an LRU relink, about what a UF2 glyph lookup costs.
+ */
+
+#define KD_PSF_MAGIC 0x864ab572
+#define KD_PSF_CACHE 1024
+#define KD_PSF_BUCKETS 2048 /* power of two */
+
+typedef struct {
+    kd_glyph glyph;
+    uint32_t cp;
+    int scale;
+    int hnext;      /* next entry in the same bucket, -1 ends the chain */
+    int prev, next; /* LRU list, most recently used first */
+} kd_psf_entry;
+
+typedef struct {
+    const uint8_t *data; /* mapped file, NULL if no font is open */
+    size_t size;
+    const uint8_t *glyphs;
+    const uint8_t *table; /* unicode table, NULL maps code points 1:1 */
+    uint32_t count, bytes, stride;
+    int width, height;
+
+    uint32_t *map; /* open addressing pairs of (cp + 1, glyph index) */
+    uint32_t map_mask;
+    int map_built;
+
+    kd_psf_entry *cache;
+    int *buckets;
+    int used, head, tail;
+    unsigned long evictions; /* lets callers holding glyphs notice reuse */
+} kd_psf;
+
+static inline uint32_t kd_le32(const uint8_t *b) {
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+/* Map the PSF2 font at path. Returns 0 on success, -1 if it cannot be read
+ * or is not a PSF2 font; p is left empty and kd_psf_glyph() draws nothing. */
+static inline int kd_psf_open(kd_psf *p, const char *path) {
+    memset(p, 0, sizeof(*p));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= 32)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const uint8_t *d = map;
+    size_t size = st.st_size;
+    uint32_t hsize = kd_le32(d + 8), flags = kd_le32(d + 12);
+    uint32_t count = kd_le32(d + 16), bytes = kd_le32(d + 20);
+    uint32_t h = kd_le32(d + 24), w = kd_le32(d + 28);
+
+    if (kd_le32(d) != KD_PSF_MAGIC || hsize < 32 || hsize > size || !count ||
+        !w || w > 32 || !h || h > 64 || bytes != (w + 7) / 8 * h ||
+        (size - hsize) / bytes < count) {
+        munmap(map, size);
+        return -1;
+    }
+
+    p->data = d;
+    p->size = size;
+    p->glyphs = d + hsize;
+    p->table = (flags & 1) ? p->glyphs + (size_t)count * bytes : NULL;
+    p->count = count;
+    p->bytes = bytes;
+    p->stride = (w + 7) / 8;
+    p->width = w;
+    p->height = h;
+    return 0;
+}
+
+static inline void kd_psf_close(kd_psf *p) {
+    if (p->cache) {
+        for (int i = 0; i < p->used; i++) free(p->cache[i].glyph.mask);
+    }
+    free(p->cache);
+    free(p->buckets);
+    free(p->map);
+    if (p->data) munmap((void *)p->data, p->size);
+    memset(p, 0, sizeof(*p));
+}
+
+static inline void kd_psf_map_put(kd_psf *p, uint32_t cp, uint32_t idx) {
+    uint32_t h = (cp * 2654435761u) & p->map_mask;
+    while (p->map[h * 2] && p->map[h * 2] != cp + 1) h = (h + 1) & p->map_mask;
+    /* The first glyph listed for a code point wins */
+    if (p->map[h * 2]) return;
+    p->map[h * 2] = cp + 1;
+    p->map[h * 2 + 1] = idx;
+}
+
+/* Walk the unicode table: per glyph, UTF-8 code points, then optional
+ * 0xfe-prefixed sequences (ignored), then 0xff. Fills the map if there is
+ * one and returns the number of code points. */
+static inline size_t kd_psf_map_scan(kd_psf *p) {
+    const uint8_t *t = p->table, *end = p->data + p->size;
+    uint32_t idx = 0;
+    size_t n = 0;
+    int seq = 0;
+
+    while (t < end && idx < p->count) {
+        uint8_t b = *t++;
+        if (b == 0xff) { idx++; seq = 0; continue; }
+        if (b == 0xfe) { seq = 1; continue; }
+
+        int len = b < 0x80 ? 0 : b >= 0xf0 ? 3 : b >= 0xe0 ? 2 : b >= 0xc0 ? 1 : -1;
+        if (len < 0 || end - t < len) continue;
+        uint32_t cp = len ? (uint32_t)(b & (0x3f >> len)) : b;
+        for (int i = 0; i < len; i++) cp = cp << 6 | (*t++ & 0x3f);
+
+        if (seq) continue;
+        if (p->map) kd_psf_map_put(p, cp, idx);
+        n++;
+    }
+    return n;
+}
+
+/* Glyph index for cp, -1 if the font has none */
+static inline int kd_psf_index(kd_psf *p, uint32_t cp) {
+    if (!p->table) return cp < p->count ? (int)cp : -1;
+
+    if (!p->map_built) {
+        p->map_built = 1;
+        size_t n = kd_psf_map_scan(p), size = 16;
+        while (size < n * 2) size *= 2;
+        p->map = calloc(size * 2, sizeof(*p->map));
+        if (!p->map) return -1;
+        p->map_mask = size - 1;
+        kd_psf_map_scan(p);
+    }
+    if (!p->map) return -1;
+
+    uint32_t h = (cp * 2654435761u) & p->map_mask;
+    for (; p->map[h * 2]; h = (h + 1) & p->map_mask) {
+        if (p->map[h * 2] == cp + 1) return p->map[h * 2 + 1];
+    }
+    return -1;
+}
+
+/* Same as kd_glyph_expand() for a PSF2 bitmap of w x h with stride bytes
+ * per row */
+static inline void kd_psf_expand(kd_glyph *g, const uint8_t *bits,
+                                 int stride, int w, int h, int scale) {
+    int x0 = w, x1 = -1, y0 = h, y1 = -1;
+
+    for (int r = 0; r < h; r++) {
+        const uint8_t *row = bits + r * stride;
+        for (int c = 0; c < w; c++) {
+            if (row[c >> 3] & (0x80 >> (c & 7))) {
+                if (c < x0) x0 = c;
+                if (c > x1) x1 = c;
+                if (r < y0) y0 = r;
+                y1 = r;
+            }
+        }
+    }
+
+    g->ready = 1;
+    if (x1 < 0) return;
+
+    g->x = x0 * scale;
+    g->y = y0 * scale;
+    g->w = (x1 - x0 + 1) * scale;
+    g->h = (y1 - y0 + 1) * scale;
+    g->mask = malloc((size_t)g->w * g->h);
+    if (!g->mask) {
+        g->ready = 0;
+        return;
+    }
+
+    for (int r = y0; r <= y1; r++) {
+        const uint8_t *src = bits + r * stride;
+        uint8_t *row = g->mask + (size_t)(r - y0) * scale * g->w;
+        for (int c = x0; c <= x1; c++) {
+            uint8_t v = (src[c >> 3] & (0x80 >> (c & 7))) ? 0xff : 0x00;
+            memset(row + (c - x0) * scale, v, scale);
+        }
+        for (int s = 1; s < scale; s++) memcpy(row + s * g->w, row, g->w);
+    }
+}
+
+static inline void kd_psf_lru_unlink(kd_psf *p, int i) {
+    kd_psf_entry *e = &p->cache[i];
+    if (e->prev >= 0) p->cache[e->prev].next = e->next;
+    else p->head = e->next;
+    if (e->next >= 0) p->cache[e->next].prev = e->prev;
+    else p->tail = e->prev;
+}
+
+static inline void kd_psf_lru_push(kd_psf *p, int i) {
+    kd_psf_entry *e = &p->cache[i];
+    e->prev = -1;
+    e->next = p->head;
+    if (p->head >= 0) p->cache[p->head].prev = i;
+    else p->tail = i;
+    p->head = i;
+}
+
+static inline uint32_t kd_psf_bucket(uint32_t cp, int scale) {
+    return ((cp * 2654435761u) ^ (uint32_t)scale) & (KD_PSF_BUCKETS - 1);
+}
+
+/* Return the cached glyph for code point cp, expanding it on first use.
+ * NULL if no font is open, the font has no glyph for cp or it is blank. */
+static inline const kd_glyph *kd_psf_glyph(kd_psf *p, uint32_t cp, int scale) {
+    if (!p->data) return NULL;
+
+    if (!p->cache) {
+        p->cache = calloc(KD_PSF_CACHE, sizeof(*p->cache));
+        p->buckets = malloc(sizeof(*p->buckets) * KD_PSF_BUCKETS);
+        if (!p->cache || !p->buckets) {
+            free(p->cache);
+            free(p->buckets);
+            p->cache = NULL;
+            p->buckets = NULL;
+            return NULL;
+        }
+        for (int i = 0; i < KD_PSF_BUCKETS; i++) p->buckets[i] = -1;
+        p->head = p->tail = -1;
+    }
+
+    uint32_t h = kd_psf_bucket(cp, scale);
+    kd_psf_entry *e;
+    int i;
+    for (i = p->buckets[h]; i >= 0; i = e->hnext) {
+        e = &p->cache[i];
+        if (e->cp == cp && e->scale == scale) break;
+    }
+
+    if (i < 0) {
+        int idx = kd_psf_index(p, cp);
+        if (idx < 0) return NULL;
+
+        if (p->used < KD_PSF_CACHE) {
+            i = p->used++;
+        } else {
+            /* Evict the least recently used glyph */
+            i = p->tail;
+            e = &p->cache[i];
+            int *link = &p->buckets[kd_psf_bucket(e->cp, e->scale)];
+            while (*link != i) link = &p->cache[*link].hnext;
+            *link = e->hnext;
+            kd_psf_lru_unlink(p, i);
+            free(e->glyph.mask);
+            p->evictions++;
+        }
+
+        e = &p->cache[i];
+        memset(&e->glyph, 0, sizeof(e->glyph));
+        e->cp = cp;
+        e->scale = scale;
+        e->hnext = p->buckets[h];
+        p->buckets[h] = i;
+        kd_psf_lru_push(p, i);
+        kd_psf_expand(&e->glyph, p->glyphs + (size_t)idx * p->bytes,
+                      p->stride, p->width, p->height, scale);
+        return e->glyph.mask ? &e->glyph : NULL;
+    }
+
+    if (p->head != i) {
+        kd_psf_lru_unlink(p, i);
+        kd_psf_lru_push(p, i);
+    }
+    if (!e->glyph.ready) {
+        /* Expansion ran out of memory last time */
+        int idx = kd_psf_index(p, cp);
+        kd_psf_expand(&e->glyph, p->glyphs + (size_t)idx * p->bytes,
+                      p->stride, p->width, p->height, scale);
+    }
+    return e->glyph.mask ? &e->glyph : NULL;
+}
+
+#endif /* _WIN32 */
+
+/* ============================================================================
+ * TEXT
+ * ============================================================================ */
+
+/* Draw s at (x, y) and return the pen x position after the last glyph. */
+static inline int kd_text(uint32_t *buf, int bw, int bh,
+                          const unsigned char *font, int x, int y,
+                          const char *s, int scale, uint32_t c) {
+    while (*s) {
+        unsigned char chr = (unsigned char)*s++;
+        kd_glyph_blit(buf, bw, bh, kd_glyph_get(font, chr, scale), x, y, c);
+        x += font[chr] * scale;
+    }
+    return x;
+}
+
+#endif /* KDRAW_H */
@@ -6,19 +6,28 @@
  *
  * Provides utilities and GUI abstractions on top of fenster.h:
  *   - Scale parsing (K_SCALE environment variable)
- *   - Frame timing (60fps target)
+ *   - Event-driven frame loop: redraw on kg_invalidate(), at most at 60fps,
+ *     and sleep on the X connection while idle
  *   - Key repeat with configurable delay/rate
  *   - Clipboard (via xclip on Linux)
  *   - Layout regions with padding
  *   - Text rendering with alignment
  *   - Scrollable views
  *   - Click/double-click handling
+ *   - Frame profiler (K_PROFILE environment variable)
  */
 
 #include "fenster.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#if !defined(__APPLE__) && !defined(_WIN32)
+#include <poll.h>
+#endif
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
 
 /* ============================================================================
  * SCALING
@@ -74,12 +83,19 @@ static inline void kg_frame_wait(kg_frame_timer *t) {
 #define KG_KEY_REPEAT_DELAY_MS 400
 #define KG_KEY_REPEAT_RATE_MS  30
 
+#define KG_KEY_FRAME_MAX 16
+
 typedef struct {
-    int prev_keys[256];
-    int64_t press_time[256];
-    int64_t repeat_time[256];
     int delay_ms;
     int rate_ms;
+    /* Last pressed key, repeated by kg_key_process() while held */
+    int repeat_key;
+    int64_t repeat_next;
+    /* Keys delivered by the last kg_key_process(), for kg_shortcut() */
+    int frame_n;
+    int frame_key[KG_KEY_FRAME_MAX];
+    int frame_mod[KG_KEY_FRAME_MAX];
+    int frame_event[KG_KEY_FRAME_MAX]; /* 1=pressed, 2=repeated */
 } kg_key_repeat;
 
 static inline kg_key_repeat kg_key_repeat_init(void) {
@@ -96,38 +112,52 @@ static inline kg_key_repeat kg_key_repeat_init_custom(int delay_ms, int rate_ms)
     return kr;
 }
 
-/* Returns: 0=no event, 1=key pressed, 2=key repeated */
-static inline int kg_key_check(kg_key_repeat *kr, int *keys, int key) {
-    int64_t now = fenster_time();
-    int result = 0;
-
-    if (keys[key] && !kr->prev_keys[key]) {
-        /* Fresh press */
-        kr->press_time[key] = now;
-        kr->repeat_time[key] = now;
-        result = 1;
-    } else if (keys[key] && kr->prev_keys[key]) {
-        /* Held - check for repeat */
-        if (now - kr->press_time[key] > kr->delay_ms) {
-            if (now - kr->repeat_time[key] > kr->rate_ms) {
-                kr->repeat_time[key] = now;
-                result = 2;
-            }
-        }
-    }
-    kr->prev_keys[key] = keys[key];
-    return result;
+/* Milliseconds until kg_key_process() repeats the held key, -1 if none.
+ * Lets event-driven loops sleep instead of polling at frame rate. */
+static inline int kg_key_timeout(kg_key_repeat *kr) {
+    if (!kr->repeat_key) return -1;
+    int64_t left = kr->repeat_next - fenster_time();
+    return left > 0 ? (int)left : 0;
 }
 
 /* Process all keys, call handler for each event */
 typedef void (*kg_key_handler)(int key, int mod, void *userdata);
 
-static inline void kg_key_process(kg_key_repeat *kr, int *keys, int mod,
+static inline void kg_key_record(kg_key_repeat *kr, int key, int mod, int event) {
+    if (kr->frame_n >= KG_KEY_FRAME_MAX) return;
+    kr->frame_key[kr->frame_n] = key;
+    kr->frame_mod[kr->frame_n] = mod;
+    kr->frame_event[kr->frame_n] = event;
+    kr->frame_n++;
+}
+
+/* Deliver the queued key presses in order, then repeat the last pressed key
+ * once held for delay_ms and every rate_ms after that. The repeat schedule
+ * starts at the press timestamp, not at the frame that saw it. handler may
+ * be NULL when the frame's keys are only queried with kg_shortcut(). */
+static inline void kg_key_process(kg_key_repeat *kr, struct fenster *f,
                                   kg_key_handler handler, void *userdata) {
-    for (int k = 0; k < 256; k++) {
-        int event = kg_key_check(kr, keys, k);
-        if (event) {
-            handler(k, mod, userdata);
+    struct fenster_event ev;
+    kr->frame_n = 0;
+    while (fenster_event(f, &ev)) {
+        if (ev.down) {
+            kg_key_record(kr, ev.key, ev.mod, 1);
+            if (handler) handler(ev.key, ev.mod, userdata);
+            kr->repeat_key = ev.key;
+            kr->repeat_next = ev.time + kr->delay_ms;
+        } else if (ev.key == kr->repeat_key) {
+            kr->repeat_key = 0;
+        }
+    }
+    /* Released without an event, e.g. on focus loss */
+    if (kr->repeat_key && !f->keys[kr->repeat_key]) kr->repeat_key = 0;
+
+    if (kr->repeat_key) {
+        int64_t now = fenster_time();
+        if (now >= kr->repeat_next) {
+            kg_key_record(kr, kr->repeat_key, f->mod, 2);
+            if (handler) handler(kr->repeat_key, f->mod, userdata);
+            kr->repeat_next = now + kr->rate_ms;
         }
     }
 }
@@ -238,7 +268,9 @@ typedef struct {
     int mouse_down;
     int mouse_pressed;   /* Just pressed this frame */
     int mouse_released;  /* Just released this frame */
+    int mouse_moved;     /* Pointer moved since last frame */
     int prev_mouse;
+    int prev_x, prev_y;
 
     /* Double-click detection */
     int64_t last_click_time;
@@ -247,8 +279,212 @@ typedef struct {
 
     /* Scroll wheel: -1 down, 0 none, +1 up */
     int scroll;
+
+    /* Redraw requested by kg_invalidate(), window size it was drawn at */
+    int invalid;
+    int drawn_w, drawn_h;
 } kg_ctx;
 
+/* ============================================================================
+ * PROFILER
+ * ============================================================================ */
+
+/*
+ * K_PROFILE=1 times three phases of every drawn frame:
+ *   input    kg_frame_begin() until the app starts drawing (key handling)
+ *   draw     the app's draw, up to kg_frame_end()
+ *   present  the following fenster_loop(): putting the image, reading events
+ * Only the last KG_PROF_HISTORY frames are kept; their p50/p99/max are
+ * printed on exit. Every frame is appended to the CSV file named by
+ * K_PROFILE_CSV (default /tmp/kprofile-<pid>.csv) as it completes. K_PROFILE=2 also draws a graph of the window in
+ * the top-right corner: one bar per frame, input/draw/present stacked, and
+ * a line at 16ms.
+ */
+
+#define KG_PROF_HISTORY 100
+#define KG_PROF_BAR_W   2
+#define KG_PROF_GRAPH_H 48
+#define KG_PROF_US_PX   500  /* microseconds per graph pixel */
+
+typedef struct {
+    int32_t input_us, draw_us, present_us;
+} kg_prof_sample;
+
+typedef struct {
+    int on, overlay;
+    int drawing;  /* between kg_prof_draw_begin() and kg_prof_draw_end() */
+    int pending;  /* frame drawn, its present is timed at the next begin */
+    int64_t t_begin, t_draw, t_idle;
+    kg_prof_sample cur;
+    kg_prof_sample hist[KG_PROF_HISTORY]; /* ring, frame i at i % size */
+    size_t nframes;
+    FILE *csv;
+} kg_profiler;
+
+static kg_profiler kg_prof;
+
+static inline int64_t kg_prof_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (int64_t)(count.QuadPart * 1000000.0 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static inline int32_t kg_prof_total(const kg_prof_sample *s) {
+    return s->input_us + s->draw_us + s->present_us;
+}
+
+static int kg_prof_cmp(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Number of frames in the history, and frame i of them, oldest first */
+static inline size_t kg_prof_nhist(void) {
+    return kg_prof.nframes < KG_PROF_HISTORY ? kg_prof.nframes : KG_PROF_HISTORY;
+}
+
+static inline const kg_prof_sample *kg_prof_hist(size_t i) {
+    return &kg_prof.hist[(kg_prof.nframes - kg_prof_nhist() + i) % KG_PROF_HISTORY];
+}
+
+/* p50, p99 and max of one phase over the last KG_PROF_HISTORY frames.
+ * phase is 0..2 for input/draw/present, 3 for their sum. */
+static inline void kg_prof_stats(int phase, int32_t out[3]) {
+    int32_t v[KG_PROF_HISTORY];
+    size_t n = kg_prof_nhist();
+    out[0] = out[1] = out[2] = 0;
+    if (!n) return;
+    for (size_t i = 0; i < n; i++) {
+        const kg_prof_sample *s = kg_prof_hist(i);
+        v[i] = phase == 0 ? s->input_us : phase == 1 ? s->draw_us :
+               phase == 2 ? s->present_us : kg_prof_total(s);
+    }
+    qsort(v, n, sizeof(v[0]), kg_prof_cmp);
+    out[0] = v[n / 2];
+    out[1] = v[(n * 99) / 100];
+    out[2] = v[n - 1];
+}
+
+static inline void kg_prof_push(const kg_prof_sample *s) {
+    if (kg_prof.csv) {
+        fprintf(kg_prof.csv, "%zu,%d,%d,%d,%d\n", kg_prof.nframes, s->input_us,
+                s->draw_us, s->present_us, kg_prof_total(s));
+    }
+    kg_prof.hist[kg_prof.nframes++ % KG_PROF_HISTORY] = *s;
+}
+
+static void kg_prof_exit(void) {
+    static const char *names[] = {"input", "draw", "present", "total"};
+    fprintf(stderr, "kgui: %zu frames, last %d (us):\n", kg_prof.nframes, KG_PROF_HISTORY);
+    for (int p = 0; p < 4; p++) {
+        int32_t st[3];
+        kg_prof_stats(p, st);
+        fprintf(stderr, "  %-8s p50 %7d  p99 %7d  max %7d\n", names[p], st[0], st[1], st[2]);
+    }
+    if (kg_prof.csv) fclose(kg_prof.csv);
+}
+
+static inline void kg_prof_init(void) {
+    char *env = getenv("K_PROFILE");
+    if (!env || atoi(env) <= 0 || kg_prof.on) return;
+    kg_prof.on = 1;
+    kg_prof.overlay = atoi(env) >= 2;
+    char path[256], *csv = getenv("K_PROFILE_CSV");
+    if (csv) {
+        snprintf(path, sizeof(path), "%s", csv);
+    } else {
+#ifdef _WIN32
+        snprintf(path, sizeof(path), "kprofile.csv");
+#else
+        snprintf(path, sizeof(path), "/tmp/kprofile-%d.csv", (int)getpid());
+#endif
+    }
+    kg_prof.csv = fopen(path, "w");
+    if (kg_prof.csv) {
+        fprintf(kg_prof.csv, "frame,input_us,draw_us,present_us,total_us\n");
+        fprintf(stderr, "kgui: frame times written to %s\n", path);
+    } else {
+        fprintf(stderr, "kgui: cannot write %s\n", path);
+    }
+    atexit(kg_prof_exit);
+}
+
+/* Start of a loop iteration: closes the present phase of the last frame */
+static inline void kg_prof_frame_begin(void) {
+    if (!kg_prof.on) return;
+    kg_prof.t_begin = kg_prof_us();
+    if (kg_prof.pending) {
+        kg_prof.cur.present_us = (int32_t)(kg_prof.t_begin - kg_prof.t_idle);
+        kg_prof_push(&kg_prof.cur);
+        kg_prof.pending = 0;
+    }
+}
+
+/* The app is about to draw. kg_frame_ready() calls this; loops of their own
+ * call it around their draw together with kg_prof_draw_end(). */
+static inline void kg_prof_draw_begin(void) {
+    if (!kg_prof.on) return;
+    kg_prof.t_draw = kg_prof_us();
+    kg_prof.cur.input_us = (int32_t)(kg_prof.t_draw - kg_prof.t_begin);
+    kg_prof.drawing = 1;
+}
+
+static inline void kg_prof_overlay(kg_ctx *ctx) {
+    struct fenster *f = ctx->f;
+    int gw = KG_PROF_HISTORY * KG_PROF_BAR_W;
+    int line_h = 16 * ctx->scale.font_scale;
+    int pw = gw + 8, ph = KG_PROF_GRAPH_H + line_h + 12;
+    int px = f->width - pw - 4, py = 4;
+    int gx = px + 4, gy = py + line_h + 8 + KG_PROF_GRAPH_H; /* graph baseline */
+    static const uint32_t colors[3] = {0x4aa0e0, 0xe0a040, 0x60c060};
+
+    /* Opaque so that apps repainting only their damage do not stack it */
+    kd_fill_rect(f->buf, f->width, f->height, px, py, pw, ph, 0x202020);
+
+    size_t n = kg_prof_nhist();
+    for (size_t i = 0; i < n; i++) {
+        const kg_prof_sample *s = kg_prof_hist(i);
+        int32_t us[3] = {s->input_us, s->draw_us, s->present_us};
+        int x = gx + (int)(KG_PROF_HISTORY - n + i) * KG_PROF_BAR_W, y = gy;
+        for (int p = 0; p < 3; p++) {
+            int h = us[p] / KG_PROF_US_PX;
+            if (y - h < gy - KG_PROF_GRAPH_H) h = y - (gy - KG_PROF_GRAPH_H);
+            kd_fill_rect(f->buf, f->width, f->height, x, y - h, KG_PROF_BAR_W, h, colors[p]);
+            y -= h;
+        }
+    }
+    kd_fill_rect(f->buf, f->width, f->height, gx, gy - 16000 / KG_PROF_US_PX, gw, 1, 0xc04040);
+
+    char text[64];
+    int32_t st[3];
+    kg_prof_stats(3, st);
+    snprintf(text, sizeof(text), "p50 %.1f p99 %.1f max %.1fms", st[0] / 1000.0,
+             st[1] / 1000.0, st[2] / 1000.0);
+    kd_text(f->buf, f->width, f->height, ctx->font, gx, py + 4, text,
+            ctx->scale.font_scale, 0xe0e0e0);
+    fenster_damage(f, px, py, pw, ph);
+}
+
+/* The app finished drawing. Draws the overlay, which is not timed. */
+static inline void kg_prof_draw_end(kg_ctx *ctx) {
+    if (!kg_prof.on || !kg_prof.drawing) return;
+    kg_prof.t_idle = kg_prof_us();
+    kg_prof.cur.draw_us = (int32_t)(kg_prof.t_idle - kg_prof.t_draw);
+    kg_prof.drawing = 0;
+    kg_prof.pending = 1;
+    if (kg_prof.overlay) {
+        kg_prof_overlay(ctx);
+        kg_prof.t_idle = kg_prof_us();
+    }
+}
+
 static inline kg_ctx kg_init(struct fenster *f, unsigned char *font) {
     kg_ctx ctx = {0};
     ctx.f = f;
@@ -256,17 +492,29 @@ static inline kg_ctx kg_init(struct fenster *f, unsigned char *font) {
     ctx.key_repeat = kg_key_repeat_init();
     ctx.frame_timer = kg_frame_timer_init(60);
     ctx.font = font;
+    ctx.invalid = 1;
+    kg_prof_init();
     return ctx;
 }
 
+/* Ask for a redraw, picked up by the next kg_frame_ready() */
+static inline void kg_invalidate(kg_ctx *ctx) {
+    ctx->invalid = 1;
+}
+
 /* Call at start of each frame */
 static inline void kg_frame_begin(kg_ctx *ctx) {
+    kg_prof_frame_begin();
+
     /* Update mouse state */
     ctx->mouse_x = ctx->f->x;
     ctx->mouse_y = ctx->f->y;
     ctx->mouse_down = ctx->f->mouse;
     ctx->mouse_pressed = ctx->mouse_down && !ctx->prev_mouse;
     ctx->mouse_released = !ctx->mouse_down && ctx->prev_mouse;
+    ctx->mouse_moved = ctx->mouse_x != ctx->prev_x || ctx->mouse_y != ctx->prev_y;
+    ctx->prev_x = ctx->mouse_x;
+    ctx->prev_y = ctx->mouse_y;
 
     /* Double-click detection */
     ctx->double_clicked = 0;
@@ -288,11 +536,64 @@ static inline void kg_frame_begin(kg_ctx *ctx) {
     /* Capture scroll wheel and reset for next frame */
     ctx->scroll = ctx->f->scroll;
     ctx->f->scroll = 0;
+
+    /* Input every app reacts to; keys and hover are up to the app */
+    if (ctx->f->width != ctx->drawn_w || ctx->f->height != ctx->drawn_h ||
+        ctx->mouse_pressed || ctx->mouse_released || ctx->scroll ||
+        (ctx->mouse_down && ctx->mouse_moved)) {
+        kg_invalidate(ctx);
+    }
+}
+
+/* Frame interval: the timer target, stretched to how long the server took
+ * to present the last frame so slow displays are not flooded */
+static inline int64_t kg_frame_interval(kg_ctx *ctx) {
+    int64_t ms = ctx->frame_timer.target_ms;
+    return ctx->f->frame_ms > ms ? ctx->f->frame_ms : ms;
 }
 
-/* Call at end of each frame */
+/* Non-zero if the app should draw now: a redraw was requested and the frame
+ * interval has passed since the last one. Clears the request. */
+static inline int kg_frame_ready(kg_ctx *ctx) {
+    int64_t now = fenster_time();
+    if (!ctx->invalid || now - ctx->frame_timer.last_frame < kg_frame_interval(ctx))
+        return 0;
+    ctx->invalid = 0;
+    ctx->frame_timer.last_frame = now;
+    kg_prof_draw_begin();
+    ctx->drawn_w = ctx->f->width;
+    ctx->drawn_h = ctx->f->height;
+    return 1;
+}
+
+/* Call at end of each frame. Sleeps on the X connection until input
+ * arrives, a requested redraw is due or a held key repeats, so an idle
+ * window costs no CPU. Other platforms poll at the frame rate. */
 static inline void kg_frame_end(kg_ctx *ctx) {
+    kg_prof_draw_end(ctx);
+#if !defined(__APPLE__) && !defined(_WIN32)
+    struct fenster *f = ctx->f;
+    int timeout = -1;
+
+    if (ctx->invalid) {
+        int64_t left = kg_frame_interval(ctx) -
+                       (fenster_time() - ctx->frame_timer.last_frame);
+        timeout = left > 0 ? (int)left : 0;
+    }
+    int key_timeout = kg_key_timeout(&ctx->key_repeat);
+    if (key_timeout >= 0 && (timeout < 0 || key_timeout < timeout)) timeout = key_timeout;
+    /* Frames waiting to be presented or events already read */
+    if (f->dirty || f->ndamage || fenster_pending(f)) timeout = 0;
+
+    if (timeout) {
+        struct pollfd pfd = { .fd = fenster_fd(f), .events = POLLIN };
+        poll(&pfd, 1, timeout);
+    }
+#else
     kg_frame_wait(&ctx->frame_timer);
+#endif
+    /* Sleeping is not part of the present phase */
+    if (kg_prof.pending) kg_prof.t_idle = kg_prof_us();
 }
 
 /* ============================================================================
@@ -377,9 +678,7 @@ static inline int kg_region_inner_h(kg_region *r) {
 
 static inline void kg_fill(kg_ctx *ctx, uint32_t color) {
     struct fenster *f = ctx->f;
-    for (int i = 0; i < f->width * f->height; i++) {
-        f->buf[i] = color;
-    }
+    kd_span_fill(f->buf, f->width * f->height, color);
 }
 
 static inline void kg_fill_region(kg_ctx *ctx, kg_region *r, uint32_t color) {
@@ -605,14 +904,13 @@ static inline int kg_hovered_rect(kg_ctx *ctx, int x, int y, int w, int h) {
  * SHORTCUT HELPERS
  * ============================================================================ */
 
-/* Check if a key+mod combination was just pressed or repeated */
+/* Check if a key+mod combination was pressed or repeated in this frame's
+ * kg_key_process() call. Returns 0=no event, 1=key pressed, 2=key repeated */
 static inline int kg_shortcut(kg_ctx *ctx, int key, int mod_mask, int mod_value) {
-    int event = kg_key_check(&ctx->key_repeat, ctx->f->keys, key);
-    if (event) {
-        int mod = ctx->f->mod;
-        if ((mod & mod_mask) == mod_value) {
-            return event;
-        }
+    kg_key_repeat *kr = &ctx->key_repeat;
+    for (int i = 0; i < kr->frame_n; i++) {
+        if (kr->frame_key[i] == key && (kr->frame_mod[i] & mod_mask) == mod_value)
+            return kr->frame_event[i];
     }
     return 0;
 }
@@ -255,7 +255,7 @@ static void draw(void) {
   struct fenster *f = ctx.f;
   int w = f->width;
   int h = f->height;
-  for (int i = 0; i < w * h; i++) f->buf[i] = BG_COLOR;
+  kd_span_fill(f->buf, w * h, BG_COLOR);
 
   int visible_lines = (h - padding * 2) / char_h;
   int start_line = scroll_y / char_h;
@@ -304,6 +304,7 @@ static int cursor_moved = 0;
 
 static void handle_key(int k, int mod, void *userdata) {
   (void)userdata;
+  kg_invalidate(&ctx);
   int ctrl = mod & KG_MOD_CTRL;
   int shift = mod & KG_MOD_SHIFT;
   cursor_moved = 1;
@@ -449,11 +450,13 @@ static int run(const char *path) {
 
     /* Handle keyboard */
     cursor_moved = 0;
-    kg_key_process(&ctx.key_repeat, f.keys, f.mod, handle_key, NULL);
+    kg_key_process(&ctx.key_repeat, &f, handle_key, NULL);
 
     if (cursor_moved) scroll_to_cursor();
-    draw();
-    ctx.f->dirty = true;
+    if (kg_frame_ready(&ctx)) {
+      draw();
+      ctx.f->dirty = true;
+    }
 
     kg_frame_end(&ctx);
   }
@@ -481,7 +484,8 @@ int main(int argc, char **argv) {
     }
   }
   
-  if (!detached) {
+  /* Headless runs are scripted, keep them attached to the caller */
+  if (!detached && !getenv("FENSTER_HEADLESS")) {
     pid_t pid = fork();
     if (pid < 0) {
       return 1;
@@ -8,7 +8,8 @@
 #include <pty.h>
 #include <signal.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -20,6 +21,9 @@
 #define BASE_CHAR_W 9
 #define BASE_CHAR_H 16
 #define BASE_PADDING 2
+#define PTY_BUF_SIZE (256 * 1024)
+#define SEARCH_MAX 256
+#define SEARCH_BUDGET 20000
 
 static kg_ctx ctx;
 static int char_w = 9;
@@ -28,6 +32,11 @@ static int padding = 2;
 
 static uint32_t default_bg = 0xffffff;
 
+/* Glyphs outside the UF2 font come from the PSF2 font named by K_FONT,
+ * which must be no larger than a cell */
+static kd_psf wide_font;
+static int wide_font_dy = 0;
+
 static int master_fd = -1;
 static pid_t child_pid = -1;
 static int quit_requested = 0;
@@ -41,7 +50,30 @@ static struct tsm_vte *vte = NULL;
 static int mouse_pressed = 0;
 static int selection_active = 0;
 static char *clipboard_text = NULL;
-static int idle_frames = 0;
+
+/* Scrollback search (Ctrl+Shift+F). Scans over a large scrollback buffer run
+ * SEARCH_BUDGET lines per loop iteration so typing never stalls. */
+static int search_mode = 0;
+static char search_query[SEARCH_MAX];
+static int search_len = 0;
+static int search_status = 0;
+
+/* Damage tracking: age of the last frame pushed to the framebuffer. Cells
+ * whose TSM age is not newer than this are already on screen and skipped.
+ * Zero forces a full repaint. */
+static tsm_age_t drawn_age = 0;
+static unsigned int drawn_buf_id = 0;
+static int drawn_w = 0, drawn_h = 0;
+
+/* Column span of the row being repainted, flushed to fenster_damage() */
+static int damage_row = -1, damage_x0, damage_x1;
+
+static void flush_damage(void) {
+  if (damage_row < 0) return;
+  fenster_damage(ctx.f, padding + damage_x0 * char_w, padding + damage_row * char_h,
+                 (damage_x1 - damage_x0 + 1) * char_w, char_h);
+  damage_row = -1;
+}
 
 static uint32_t palette[TSM_COLOR_NUM] = {
   [TSM_COLOR_BLACK]         = 0x1d1f21,
@@ -133,28 +165,6 @@ static void handle_mouse(void) {
   }
 }
 
-static uint32_t attr_to_color(const struct tsm_screen_attr *attr, int is_fg) {
-  if (is_fg) {
-    if (attr->fccode >= 0 && attr->fccode < TSM_COLOR_NUM) {
-      return palette[attr->fccode];
-    }
-    /* If RGB is all zero, use default foreground */
-    if (attr->fr == 0 && attr->fg == 0 && attr->fb == 0) {
-      return palette[TSM_COLOR_FOREGROUND];
-    }
-    return (attr->fr << 16) | (attr->fg << 8) | attr->fb;
-  } else {
-    if (attr->bccode >= 0 && attr->bccode < TSM_COLOR_NUM) {
-      return palette[attr->bccode];
-    }
-    /* If RGB is all zero, use default background */
-    if (attr->br == 0 && attr->bg == 0 && attr->bb == 0) {
-      return palette[TSM_COLOR_BACKGROUND];
-    }
-    return (attr->br << 16) | (attr->bg << 8) | attr->bb;
-  }
-}
-
 static char box_to_ascii(uint32_t c) {
   if (c >= 0x2500 && c <= 0x257F) {
     switch (c) {
@@ -178,43 +188,265 @@ static char box_to_ascii(uint32_t c) {
   return 0;
 }
 
-static int draw_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch,
-                   size_t len, unsigned int width, unsigned int posx,
-                   unsigned int posy, const struct tsm_screen_attr *attr,
-                   tsm_age_t age, void *data) {
+/* Glyph for code point c and its vertical offset from the cell top. Not
+ * thread-safe: glyphs are expanded into the caches on first use. */
+static const kd_glyph *resolve_glyph(uint32_t c, int *dy) {
+  const kd_glyph *g = NULL;
+
+  *dy = 0;
+  if (c > 127) g = kd_psf_glyph(&wide_font, c, ctx.scale.font_scale);
+  if (g) {
+    *dy = wide_font_dy;
+    return g;
+  }
+  char ascii = box_to_ascii(c);
+  if (ascii) c = ascii;
+  return kd_glyph_get(terminus, c < 256 ? c : 0, ctx.scale.font_scale);
+}
+
+static void run_colors(const struct tsm_screen_run *run, uint32_t *fg, uint32_t *bg) {
+  *fg = run->fg;
+  *bg = run->bg;
+  if (run->attr.match) {
+    *fg = palette[TSM_COLOR_FOREGROUND];
+    *bg = run->attr.match_focus ? 0xf0a830 : 0xfff0b0;
+  }
+}
+
+/* One background span per run, glyphs only for runs that have any */
+static int draw_run_cb(struct tsm_screen *con, const struct tsm_screen_run *run,
+                       void *data) {
   (void)con;
-  (void)id;
-  (void)width;
-  (void)age;
   (void)data;
 
+  /* Unchanged since the last frame, pixels are still valid */
+  if (run->age && drawn_age && run->age <= drawn_age) return 0;
+
   struct fenster *f = ctx.f;
-  int x = padding + posx * char_w;
-  int y = padding + posy * char_h;
+  int x = padding + run->posx * char_w;
+  int y = padding + run->posy * char_h;
+  uint32_t fg, bg;
+  run_colors(run, &fg, &bg);
+
+  fenster_rect(f, x, y, run->cells * char_w, char_h, bg);
+
+  if ((int)run->posy != damage_row) {
+    flush_damage();
+    damage_row = run->posy;
+    damage_x0 = run->posx;
+  }
+  damage_x1 = run->posx + run->cells - 1;
+
+  if (run->blank) return 0;
+  for (unsigned int i = 0; i < run->cells; i++) {
+    if (!run->ch[i]) continue;
+    int dy;
+    const kd_glyph *g = resolve_glyph(run->ch[i], &dy);
+    kd_glyph_blit(f->buf, f->width, f->height, g, x + i * char_w, y + dy, fg);
+  }
+
+  return 0;
+}
+
+/* ============================================================================
+ * BAND RASTERIZER
+ * ============================================================================ */
+
+/*
+ * Full redraws (resize, alternate screen, scrollback paging) repaint every
+ * cell. The main thread walks the screen once, resolving runs to spans and
+ * glyph pointers, which is the only part touching TSM and the glyph caches.
+ * The framebuffer is then filled in horizontal bands of rows, one per
+ * thread, each clipped to its own pixel rows, and the frame is presented
+ * once every band is done. Partial redraws keep using draw_run_cb().
+ */
+
+#define RASTER_THREADS 8
+
+typedef struct {
+  int x, y, w;
+  uint32_t bg, fg;
+  int glyph, glyphs; /* slice of raster.glyphs */
+} raster_span;
+
+typedef struct {
+  const kd_glyph *g;
+  int x, y;
+} raster_glyph;
+
+static struct {
+  raster_span *spans;
+  int nspans, spans_cap;
+  raster_glyph *glyphs;
+  int nglyphs, glyphs_cap;
+  int *row_first; /* first span of each row, rows + 1 entries */
+  int nrows, row_cap;
+  int failed;
+
+  pthread_t threads[RASTER_THREADS - 1];
+  int nthreads, started;
+  pthread_mutex_t lock;
+  pthread_cond_t go, done;
+  unsigned int frame;
+  int pending, stop;
+} raster = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .go = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
 
-  uint32_t fg = attr_to_color(attr, 1);
-  uint32_t bg = attr_to_color(attr, 0);
+static void *raster_grow(void *p, int *cap, int need, size_t size) {
+  if (need <= *cap) return p;
+  int n = *cap ? *cap : 1024;
+  while (n < need) n *= 2;
+  void *np = realloc(p, n * size);
+  if (!np) return NULL;
+  *cap = n;
+  return np;
+}
 
-  if (attr->inverse) {
-    uint32_t tmp = fg;
-    fg = bg;
-    bg = tmp;
+static int raster_collect_cb(struct tsm_screen *con, const struct tsm_screen_run *run,
+                             void *data) {
+  (void)con;
+  (void)data;
+  if (raster.failed) return 0;
+
+  raster_span *spans = raster_grow(raster.spans, &raster.spans_cap,
+                                   raster.nspans + 1, sizeof(*spans));
+  raster_glyph *glyphs = raster_grow(raster.glyphs, &raster.glyphs_cap,
+                                     raster.nglyphs + run->cells, sizeof(*glyphs));
+  if (spans) raster.spans = spans;
+  if (glyphs) raster.glyphs = glyphs;
+  if (!spans || !glyphs) {
+    raster.failed = 1;
+    return 0;
   }
 
-  fenster_rect(f, x, y, char_w, char_h, bg);
+  while (raster.nrows <= (int)run->posy) raster.row_first[raster.nrows++] = raster.nspans;
+
+  raster_span *sp = &raster.spans[raster.nspans++];
+  sp->x = padding + run->posx * char_w;
+  sp->y = padding + run->posy * char_h;
+  sp->w = run->cells * char_w;
+  run_colors(run, &sp->fg, &sp->bg);
+  sp->glyph = raster.nglyphs;
+
+  if (!run->blank) {
+    for (unsigned int i = 0; i < run->cells; i++) {
+      if (!run->ch[i]) continue;
+      int dy;
+      const kd_glyph *g = resolve_glyph(run->ch[i], &dy);
+      if (!g) continue;
+      raster_glyph *rg = &raster.glyphs[raster.nglyphs++];
+      rg->g = g;
+      rg->x = sp->x + i * char_w;
+      rg->y = sp->y + dy;
+    }
+  }
+  sp->glyphs = raster.nglyphs - sp->glyph;
+  return 0;
+}
 
-  if (len > 0) {
-    uint32_t c = ch[0];
-    char ascii = box_to_ascii(c);
-    if (ascii) {
-      char tmp[2] = { ascii, 0 };
-      fenster_text(f, terminus, x, y, tmp, ctx.scale.font_scale, fg);
-    } else if (c > 32 && c < 127) {
-      char tmp[2] = { (char)c, 0 };
-      fenster_text(f, terminus, x, y, tmp, ctx.scale.font_scale, fg);
+/* Clear and paint band b of n: its screen rows and the pixel rows they own */
+static void raster_band(int b, int n) {
+  struct fenster *f = ctx.f;
+  int r0 = rows * b / n, r1 = rows * (b + 1) / n;
+  int y0 = b ? padding + r0 * char_h : 0;
+  int y1 = b < n - 1 ? padding + r1 * char_h : f->height;
+  if (y1 > f->height) y1 = f->height;
+  if (y0 >= y1) return;
+
+  uint32_t *buf = f->buf + (size_t)y0 * f->width;
+  int bh = y1 - y0;
+  kd_span_fill(buf, f->width * bh, default_bg);
+
+  for (int s = raster.row_first[r0]; s < raster.row_first[r1]; s++) {
+    const raster_span *sp = &raster.spans[s];
+    kd_fill_rect(buf, f->width, bh, sp->x, sp->y - y0, sp->w, char_h, sp->bg);
+    for (int i = sp->glyph; i < sp->glyph + sp->glyphs; i++) {
+      const raster_glyph *rg = &raster.glyphs[i];
+      kd_glyph_blit(buf, f->width, bh, rg->g, rg->x, rg->y - y0, sp->fg);
     }
   }
+}
+
+static void *raster_worker(void *arg) {
+  int band = (int)(intptr_t)arg;
+  unsigned int seen = 0;
 
+  pthread_mutex_lock(&raster.lock);
+  for (;;) {
+    while (raster.frame == seen && !raster.stop)
+      pthread_cond_wait(&raster.go, &raster.lock);
+    if (raster.stop) break;
+    seen = raster.frame;
+    int n = raster.nthreads + 1;
+    pthread_mutex_unlock(&raster.lock);
+
+    raster_band(band, n);
+
+    pthread_mutex_lock(&raster.lock);
+    if (--raster.pending == 0) pthread_cond_signal(&raster.done);
+  }
+  pthread_mutex_unlock(&raster.lock);
+  return NULL;
+}
+
+static void raster_start(void) {
+  raster.started = 1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int want = cpus > RASTER_THREADS ? RASTER_THREADS : (int)cpus;
+  for (int i = 0; i < want - 1; i++) {
+    if (pthread_create(&raster.threads[i], NULL, raster_worker,
+                       (void *)(intptr_t)(i + 1)) != 0) break;
+    raster.nthreads++;
+  }
+}
+
+static void raster_stop(void) {
+  pthread_mutex_lock(&raster.lock);
+  raster.stop = 1;
+  pthread_cond_broadcast(&raster.go);
+  pthread_mutex_unlock(&raster.lock);
+  for (int i = 0; i < raster.nthreads; i++) pthread_join(raster.threads[i], NULL);
+  free(raster.spans);
+  free(raster.glyphs);
+  free(raster.row_first);
+}
+
+/* Repaint the whole frame in parallel bands and store the TSM age drawn in
+ * *age. Returns -1 if the frame has to be drawn by draw_run_cb() instead. */
+static int raster_full(tsm_age_t *age) {
+  if (!raster.started) raster_start();
+  if (!raster.nthreads) return -1;
+
+  int *rf = raster_grow(raster.row_first, &raster.row_cap, rows + 1, sizeof(*rf));
+  if (!rf) return -1;
+  raster.row_first = rf;
+  raster.nrows = 0;
+  raster.nspans = 0;
+  raster.nglyphs = 0;
+  raster.failed = 0;
+
+  /* Evicting glyphs while collecting could free ones already collected */
+  unsigned long evictions = wide_font.evictions;
+  *age = tsm_screen_draw_runs(screen, raster_collect_cb, NULL);
+  if (raster.failed || wide_font.evictions != evictions) return -1;
+  while (raster.nrows <= rows) raster.row_first[raster.nrows++] = raster.nspans;
+
+  pthread_mutex_lock(&raster.lock);
+  raster.pending = raster.nthreads;
+  raster.frame++;
+  pthread_cond_broadcast(&raster.go);
+  pthread_mutex_unlock(&raster.lock);
+
+  raster_band(0, raster.nthreads + 1);
+
+  pthread_mutex_lock(&raster.lock);
+  while (raster.pending) pthread_cond_wait(&raster.done, &raster.lock);
+  pthread_mutex_unlock(&raster.lock);
+
+  ctx.f->dirty = true;
   return 0;
 }
 
@@ -307,6 +539,62 @@ static void cancel_selection(void) {
   }
 }
 
+static void search_open(void) {
+  search_mode = 1;
+  search_len = 0;
+  search_query[0] = 0;
+  search_status = 0;
+  cancel_selection();
+  needs_redraw = 1;
+}
+
+static void search_close(void) {
+  search_mode = 0;
+  tsm_screen_search_reset(screen);
+  drawn_age = 0; /* the prompt covers the bottom row */
+  needs_redraw = 1;
+}
+
+/* Keys typed while the search prompt is open edit the query, Enter and Up
+ * go to older matches, Down to newer ones */
+static void search_key(int k, int ctrl, int shift) {
+  uint32_t c;
+
+  switch (k) {
+    case KG_KEY_ESCAPE:
+      search_close();
+      return;
+    case KG_KEY_RETURN:
+    case KG_KEY_UP:
+      tsm_screen_search_next(screen, true);
+      break;
+    case KG_KEY_DOWN:
+      tsm_screen_search_next(screen, false);
+      break;
+    case KG_KEY_BACKSPACE:
+      if (search_len == 0) return;
+      search_query[--search_len] = 0;
+      tsm_screen_search(screen, search_query, search_len);
+      break;
+    default:
+      c = get_unicode(k, shift);
+      if (ctrl || !c || search_len >= SEARCH_MAX - 1) return;
+      search_query[search_len++] = c;
+      search_query[search_len] = 0;
+      tsm_screen_search(screen, search_query, search_len);
+      break;
+  }
+
+  search_status = 0;
+  needs_redraw = 1;
+}
+
+/* Every row of the view moved: repaint the whole frame, in bands */
+static void view_scrolled(void) {
+  drawn_age = 0;
+  needs_redraw = 1;
+}
+
 static void handle_key(int k, int mod, void *userdata) {
   (void)userdata;
   int ctrl = mod & KG_MOD_CTRL;
@@ -327,25 +615,35 @@ static void handle_key(int k, int mod, void *userdata) {
     return;
   }
 
+  if (ctrl && shift && (k == 'F' || k == 'f')) {
+    search_open();
+    return;
+  }
+
   /* Scrollback navigation with shift+arrows */
   if (shift && k == KG_KEY_UP) {
     tsm_screen_sb_up(screen, 1);
-    needs_redraw = 1;
+    view_scrolled();
     return;
   }
   if (shift && k == KG_KEY_DOWN) {
     tsm_screen_sb_down(screen, 1);
-    needs_redraw = 1;
+    view_scrolled();
     return;
   }
   if (shift && k == KG_KEY_PAGEUP) {
     tsm_screen_sb_page_up(screen, 1);
-    needs_redraw = 1;
+    view_scrolled();
     return;
   }
   if (shift && k == KG_KEY_PAGEDOWN) {
     tsm_screen_sb_page_down(screen, 1);
-    needs_redraw = 1;
+    view_scrolled();
+    return;
+  }
+
+  if (search_mode) {
+    search_key(k, ctrl, shift);
     return;
   }
 
@@ -375,20 +673,85 @@ static void handle_resize(void) {
     rows = new_rows;
 
     tsm_screen_resize(screen, cols, rows);
+    if (search_mode) drawn_age = 0;
 
     struct winsize ws = { .ws_row = rows, .ws_col = cols };
     ioctl(master_fd, TIOCSWINSZ, &ws);
   }
 }
 
+/* The search prompt replaces the bottom row while search mode is active */
+static void draw_search_bar(void) {
+  struct fenster *f = ctx.f;
+  int y = padding + (rows - 1) * char_h;
+  uint32_t fg = palette[TSM_COLOR_BACKGROUND];
+  const char *status = "";
+
+  if (tsm_screen_search_pending(screen)) status = "  [searching]";
+  else if (search_status < 0) status = "  [no match]";
+
+  fenster_rect(f, 0, y, f->width, char_h, palette[TSM_COLOR_FOREGROUND]);
+  int x = kd_text(f->buf, f->width, f->height, terminus, padding, y,
+                  "search: ", ctx.scale.font_scale, fg);
+  x = kd_text(f->buf, f->width, f->height, terminus, x, y,
+              search_query, ctx.scale.font_scale, fg);
+  x = kd_text(f->buf, f->width, f->height, terminus, x, y,
+              "_", ctx.scale.font_scale, fg);
+  kd_text(f->buf, f->width, f->height, terminus, x, y,
+          status, ctx.scale.font_scale, fg);
+  fenster_damage(f, 0, y, f->width, char_h);
+}
+
 static void draw(void) {
   struct fenster *f = ctx.f;
   int w = f->width;
   int h = f->height;
 
-  for (int i = 0; i < w * h; i++) f->buf[i] = default_bg;
+  /* Buffer was reallocated or resized: contents are gone, repaint all */
+  if (f->buf_id != drawn_buf_id || w != drawn_w || h != drawn_h) {
+    drawn_age = 0;
+    drawn_buf_id = f->buf_id;
+    drawn_w = w;
+    drawn_h = h;
+  }
+
+  tsm_age_t age;
+  if (!drawn_age && raster_full(&age) == 0) {
+    drawn_age = age;
+  } else {
+    if (!drawn_age) {
+      kd_span_fill(f->buf, w * h, default_bg);
+      f->dirty = true;
+    }
+    drawn_age = tsm_screen_draw_runs(screen, draw_run_cb, NULL);
+    flush_damage();
+  }
+  if (search_mode) draw_search_bar();
+}
+
+/* Drain the PTY into the VTE. Stops early when a frame is due so a flood of
+ * output cannot starve drawing and input. Returns -1 once the child is gone. */
+static int read_pty(void) {
+  static char rd[PTY_BUF_SIZE];
+  kg_frame_timer *ft = &ctx.frame_timer;
 
-  tsm_screen_draw(screen, draw_cb, NULL);
+  for (;;) {
+    ssize_t n = read(master_fd, rd, sizeof(rd));
+    if (n > 0) {
+      tsm_vte_input(vte, rd, n);
+      needs_redraw = 1;
+      if (fenster_time() - ft->last_frame >= ft->target_ms) return 0;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+
+    /* EOF or EIO: the slave side is closed, the shell has exited */
+    int status;
+    waitpid(child_pid, &status, 0);
+    child_pid = -1;
+    return -1;
+  }
 }
 
 static int run(void) {
@@ -406,6 +769,20 @@ static int run(void) {
   cols = (W - padding * 2) / char_w;
   rows = (H - padding * 2) / char_h;
 
+  /* Only maps the file, glyphs are loaded as they are first drawn. Glyphs
+   * are not clipped to their cell, so larger fonts would draw outside the
+   * damage reported for it and the band being rasterized. */
+  const char *font_path = getenv("K_FONT");
+  if (font_path && kd_psf_open(&wide_font, font_path) == 0) {
+    if (wide_font.width > BASE_CHAR_W || wide_font.height > BASE_CHAR_H) {
+      fprintf(stderr, "K_FONT: %dx%d glyphs do not fit a %dx%d cell\n",
+              wide_font.width, wide_font.height, BASE_CHAR_W, BASE_CHAR_H);
+      kd_psf_close(&wide_font);
+    } else {
+      wide_font_dy = (BASE_CHAR_H - wide_font.height) / 2 * ctx.scale.font_scale;
+    }
+  }
+
   /* Initialize TSM screen */
   if (tsm_screen_new(&screen, NULL, NULL) < 0) {
     fprintf(stderr, "Failed to create TSM screen\n");
@@ -420,7 +797,7 @@ static int run(void) {
   tsm_screen_set_def_attr(screen, &def_attr);
 
   tsm_screen_resize(screen, cols, rows);
-  tsm_screen_set_max_sb(screen, 5000);
+  tsm_screen_set_max_sb(screen, 100000);
 
   /* Initialize TSM VTE */
   if (tsm_vte_new(&vte, screen, vte_write_cb, NULL, NULL, NULL) < 0) {
@@ -440,34 +817,19 @@ static int run(void) {
 
   fenster_open(&f);
 
+  /* Sleep until the X connection or the PTY has something for us. Output
+   * is parsed as fast as it arrives, frames are drawn at most once per
+   * frame_timer interval. */
+  struct pollfd fds[2] = {
+    { .fd = fenster_fd(&f), .events = POLLIN },
+    { .fd = master_fd, .events = POLLIN },
+  };
+  kg_frame_timer *ft = &ctx.frame_timer;
+
   while (fenster_loop(&f) == 0 && !quit_requested) {
     /* Update mouse/key state immediately after fenster_loop */
     kg_frame_begin(&ctx);
-
-    /* Process keyboard before blocking on select */
-    kg_key_process(&ctx.key_repeat, f.keys, f.mod, handle_key, NULL);
-
-    /* Use longer timeout when idle to reduce CPU usage */
-    fd_set fds;
-    int timeout_us = (idle_frames > 30) ? 50000 : 16000;  /* 100ms idle, 16ms active */
-    struct timeval tv = { .tv_sec = 0, .tv_usec = timeout_us };
-    FD_ZERO(&fds);
-    FD_SET(master_fd, &fds);
-
-    int had_activity = 0;
-    if (select(master_fd + 1, &fds, NULL, NULL, &tv) > 0) {
-      char rd[4096];
-      ssize_t n;
-      while ((n = read(master_fd, rd, sizeof(rd))) > 0) {
-        tsm_vte_input(vte, rd, n);
-        needs_redraw = 1;
-        had_activity = 1;
-      }
-      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-        int status;
-        if (waitpid(child_pid, &status, WNOHANG) != 0) break;
-      }
-    }
+    kg_key_process(&ctx.key_repeat, &f, handle_key, NULL);
 
     handle_resize();
     handle_mouse();
@@ -475,29 +837,35 @@ static int run(void) {
     /* Handle scroll wheel for scrollback */
     if (ctx.scroll > 0) {
       tsm_screen_sb_up(screen, 3);
-      needs_redraw = 1;
+      view_scrolled();
     } else if (ctx.scroll < 0) {
       tsm_screen_sb_down(screen, 3);
-      needs_redraw = 1;
-    }
-
-    /* Detect input activity */
-    if (f.keys[0] || ctx.mouse_pressed || ctx.mouse_released || ctx.mouse_down) {
-      had_activity = 1;
+      view_scrolled();
     }
 
-    /* Track idle state */
-    if (had_activity || needs_redraw) {
-      idle_frames = 0;
-    } else if (idle_frames < 100) {
-      idle_frames++;
+    /* Advance a pending search by one slice, redraw when it settles */
+    if (tsm_screen_search_pending(screen)) {
+      search_status = tsm_screen_search_run(screen, SEARCH_BUDGET);
+      needs_redraw = 1;
     }
 
-    if (needs_redraw) {
+    int64_t since = fenster_time() - ft->last_frame;
+    if (needs_redraw && since >= ft->target_ms) {
+      kg_prof_draw_begin();
       draw();
-      f.dirty = true;
+      kg_prof_draw_end(&ctx);
       needs_redraw = 0;
+      ft->last_frame = fenster_time();
+      continue; /* present it right away */
     }
+
+    int timeout = needs_redraw ? (int)(ft->target_ms - since) : -1;
+    int key_timeout = kg_key_timeout(&ctx.key_repeat);
+    if (key_timeout >= 0 && (timeout < 0 || key_timeout < timeout)) timeout = key_timeout;
+    if (f.dirty || fenster_pending(&f) || tsm_screen_search_pending(screen)) timeout = 0;
+
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+    if (fds[1].revents && read_pty() < 0) break;
   }
 
   if (child_pid > 0) { kill(child_pid, SIGHUP); waitpid(child_pid, NULL, 0); }
@@ -505,6 +873,8 @@ static int run(void) {
   free(clipboard_text);
   tsm_vte_unref(vte);
   tsm_screen_unref(screen);
+  raster_stop();
+  kd_psf_close(&wide_font);
   fenster_close(&f);
   return 0;
 }
@@ -524,7 +894,8 @@ int main(int argc, char **argv) {
     }
   }
   
-  if (!detached) {
+  /* Headless runs are scripted, keep them attached to the caller */
+  if (!detached && !getenv("FENSTER_HEADLESS")) {
     pid_t pid = fork();
     if (pid < 0) {
       return 1;
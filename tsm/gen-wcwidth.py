@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# Generate wcwidth.h, a two-stage lookup table of terminal cell widths for
+# every Unicode code point, from the Unicode database bundled with Python.
+#
+#   python3 tsm/gen-wcwidth.py > tsm/wcwidth.h
+#
+# Widths follow Markus Kuhn's wcwidth() rules:
+#   -1  C0/C1 control characters
+#    0  NUL, non-spacing and enclosing marks (Mn, Me), format characters (Cf)
+#       except U+00AD, Hangul medial vowels and final consonants, U+200B
+#    2  East Asian Wide (W) and Fullwidth (F), plus the unassigned code points
+#       of the CJK blocks and planes 2 and 3 which are wide by default
+#    1  everything else
+#
+# The first stage maps the upper bits of a code point to a block number, the
+# second stage stores 2 bits per code point in blocks of BLOCK code points.
+# Identical blocks are shared, which keeps the table at a few KiB.
+
+import sys
+import unicodedata
+
+MAX = 0x110000
+BLOCK = 256
+
+WIDE_DEFAULT = [
+    (0x3400, 0x4dbf),
+    (0x4e00, 0x9fff),
+    (0xf900, 0xfaff),
+    (0x20000, 0x2fffd),
+    (0x30000, 0x3fffd),
+]
+
+
+def width(cp):
+    if cp == 0:
+        return 0
+    if cp < 0x20 or 0x7f <= cp < 0xa0:
+        return -1
+    ch = chr(cp)
+    cat = unicodedata.category(ch)
+    if cat in ('Mn', 'Me') or (cat == 'Cf' and cp != 0x00ad):
+        return 0
+    if 0x1160 <= cp <= 0x11ff or cp == 0x200b:
+        return 0
+    if cat == 'Cn':
+        # unicodedata reports nonsense widths for unassigned code points
+        return 2 if any(lo <= cp <= hi for lo, hi in WIDE_DEFAULT) else 1
+    if unicodedata.east_asian_width(ch) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def main():
+    out = sys.stdout
+    blocks = {}
+    stage1 = []
+    stage2 = []
+
+    for base in range(0, MAX, BLOCK):
+        packed = bytearray(BLOCK // 4)
+        for i in range(BLOCK):
+            packed[i // 4] |= (width(base + i) & 3) << ((i % 4) * 2)
+        packed = bytes(packed)
+        if packed not in blocks:
+            blocks[packed] = len(blocks)
+            stage2.append(packed)
+        stage1.append(blocks[packed])
+
+    assert len(blocks) <= 256
+
+    w = out.write
+    w('#ifndef WCWIDTH_H\n')
+    w('#define WCWIDTH_H\n\n')
+    w('/*\n')
+    w(' * Generated by gen-wcwidth.py from Unicode %s, do not edit.\n'
+      % unicodedata.unidata_version)
+    w(' *\n')
+    w(' * mk_wcwidth() is two table lookups: wcwidth_stage1 maps the code point\n')
+    w(' * to a block of %d code points, wcwidth_stage2 holds 2 bits per code\n' % BLOCK)
+    w(' * point (0, 1, 2, or 3 for -1).\n')
+    w(' */\n\n')
+    w('#include <stdint.h>\n')
+    w('#include <wchar.h>\n\n')
+    w('/* Map standard wcwidth to our implementation */\n')
+    w('#define wcwidth mk_wcwidth\n\n')
+
+    w('static const uint8_t wcwidth_stage1[%d] = {\n' % len(stage1))
+    for i in range(0, len(stage1), 16):
+        w('  ' + ', '.join('%d' % v for v in stage1[i:i + 16]) + ',\n')
+    w('};\n\n')
+
+    w('static const uint8_t wcwidth_stage2[%d][%d] = {\n'
+      % (len(stage2), BLOCK // 4))
+    for packed in stage2:
+        w('  {\n')
+        for i in range(0, len(packed), 16):
+            w('    ' + ', '.join('0x%02x' % v for v in packed[i:i + 16]) + ',\n')
+        w('  },\n')
+    w('};\n\n')
+
+    w('static inline int mk_wcwidth(wchar_t ucs) {\n')
+    w('  uint32_t c = (uint32_t)ucs;\n')
+    w('  if (c >= 0x%x) return 1;\n' % MAX)
+    w('  int w = (wcwidth_stage2[wcwidth_stage1[c >> %d]][(c & 0x%x) >> 2] >> ((c & 3) * 2)) & 3;\n'
+      % (BLOCK.bit_length() - 1, BLOCK - 1))
+    w('  return w == 3 ? -1 : w;\n')
+    w('}\n\n')
+
+    w('static inline int mk_wcswidth(const wchar_t *pwcs, size_t n) {\n')
+    w('  int w, width = 0;\n')
+    w('  for (;*pwcs && n-- > 0; pwcs++) {\n')
+    w('    if ((w = mk_wcwidth(*pwcs)) < 0) return -1;\n')
+    w('    width += w;\n')
+    w('  }\n')
+    w('  return width;\n')
+    w('}\n\n')
+    w('#endif /* WCWIDTH_H */\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -53,14 +53,12 @@ tsm_symbol_t tsm_symbol_make(uint32_t ucs4);
 tsm_symbol_t tsm_symbol_append(struct tsm_symbol_table *tbl,
 			       tsm_symbol_t sym, uint32_t ucs4);
 const uint32_t *tsm_symbol_get(struct tsm_symbol_table *tbl,
-			       tsm_symbol_t *sym, size_t *size);
+			       const tsm_symbol_t *sym, size_t *size);
 unsigned int tsm_symbol_get_width(struct tsm_symbol_table *tbl,
 				  tsm_symbol_t sym);
 
 /* utf8 state machine */
 
-struct tsm_utf8_mach;
-
 enum tsm_utf8_mach_state {
 	TSM_UTF8_START,
 	TSM_UTF8_ACCEPT,
@@ -70,20 +68,32 @@ enum tsm_utf8_mach_state {
 	TSM_UTF8_EXPECT3,
 };
 
+/* exposed so callers can snapshot and restore the decoder state */
+struct tsm_utf8_mach {
+	int state;
+	uint32_t ch;
+};
+
 int tsm_utf8_mach_new(struct tsm_utf8_mach **out);
 void tsm_utf8_mach_free(struct tsm_utf8_mach *mach);
 
 int tsm_utf8_mach_feed(struct tsm_utf8_mach *mach, char c);
 uint32_t tsm_utf8_mach_get(struct tsm_utf8_mach *mach);
 void tsm_utf8_mach_reset(struct tsm_utf8_mach *mach);
+bool tsm_utf8_mach_idle(struct tsm_utf8_mach *mach);
+size_t tsm_utf8_mach_decode(struct tsm_utf8_mach *mach, const char *in,
+			    size_t len, uint32_t *out, size_t *out_len);
 
 /* TSM screen */
 
+/*
+ * Cells are kept at 8 bytes: attributes are interned into the per-screen
+ * style table and referenced by index, and ageing is tracked per line.
+ */
 struct cell {
 	tsm_symbol_t ch;		/* stored character */
-	unsigned int width;		/* character width */
-	struct tsm_screen_attr attr;	/* cell attributes */
-	tsm_age_t age;			/* age of the single cell */
+	uint32_t style : 30;		/* index into the screen style table */
+	uint32_t width : 2;		/* character width */
 };
 
 struct line {
@@ -91,11 +101,21 @@ struct line {
 	struct line *prev;		/* prev line (NULL if not sb) */
 
 	unsigned int size;		/* real width */
-	struct cell *cells;		/* actuall cells */
+	struct cell *cells;		/* actuall cells; NULL if packed */
+	uint8_t *packed;		/* compact form of cold sb lines */
+	size_t packed_size;		/* allocated size of packed */
+	uint8_t *text;			/* folded text for search, sb only */
+	unsigned int text_len;		/* length of text */
 	uint64_t sb_id;			/* sb ID */
 	tsm_age_t age;			/* age of the whole line */
+	unsigned int wrap;		/* cells continued on the next line if
+					 * soft-wrapped, 0 otherwise */
+	unsigned int cols;		/* width an sb line is laid out for */
 };
 
+/* sb ids are spaced so a reflow can number the lines it splits a line into */
+#define SB_ID_STEP (1ULL << 16)
+
 #define SELECTION_TOP -1
 struct selection_pos {
 	struct line *line;
@@ -119,6 +139,15 @@ struct tsm_screen {
 	 * screen with these attributes and not the ones of the alt screen */
 	struct tsm_screen_attr def_attr_main;
 
+	/* interned cell attributes, see screen_style_intern() */
+	struct tsm_screen_attr *styles;	/* style table */
+	unsigned int style_num;		/* used entries in the table */
+	unsigned int style_size;	/* allocated entries in the table */
+	unsigned int style_limit;	/* table size that triggers collection */
+	uint32_t *style_index;		/* hash index: style + 1, 0 if empty */
+	unsigned int style_index_size;	/* slots in the index, power of 2 */
+	unsigned int style_last;	/* last interned style */
+
 	/* ageing */
 	tsm_age_t age_cnt;		/* current age counter */
 	unsigned int age_reset : 1;	/* age-overflow flag */
@@ -143,6 +172,21 @@ struct tsm_screen {
 	unsigned int sb_pos_num;	/* current numeric position in sb */
 	uint64_t sb_last_id;		/* last id given to sb-line */
 
+	struct line *sb_hot;		/* oldest sb line not packed yet */
+	unsigned int sb_hot_num;	/* number of unpacked sb lines */
+
+	/* line pool */
+	struct line *line_pool;		/* freed lines, linked via next */
+	unsigned int line_pool_num;	/* number of lines in the pool */
+	struct cell *unpacked;		/* scratch cells of a packed line */
+	unsigned int unpacked_size;	/* allocated size of unpacked */
+	uint8_t *pack_buf;		/* scratch buffer for line packing */
+	size_t pack_buf_size;		/* allocated size of pack_buf */
+	struct cell *reflow_buf;	/* scratch text of a logical line */
+	unsigned int reflow_size;	/* allocated size of reflow_buf */
+	uint32_t *run_buf;		/* code points of the row being drawn */
+	unsigned int run_size;		/* allocated size of run_buf */
+
 	/* cursor: positions are always in-bound, but cursor_x might be
 	 * bigger than size_x if new-line is pending */
 	unsigned int cursor_x;		/* current cursor x-pos */
@@ -155,9 +199,46 @@ struct tsm_screen {
 	bool sel_active;
 	struct selection_pos sel_start;
 	struct selection_pos sel_end;
+
+	/* search, see tsm-search.c */
+	uint8_t *search_needle;		/* folded needle */
+	unsigned int search_len;	/* length of search_needle in cells */
+	uint32_t *search_ucs4;		/* needle characters */
+	unsigned int search_ucs4_len;	/* number of needle characters */
+	bool search_exact;		/* verify matches against the cells */
+	bool search_scan;		/* scan pending */
+	bool search_up;			/* scan direction */
+	uint64_t search_row;		/* next row to scan */
+	unsigned int search_x;		/* match limit within search_row */
+	struct line *search_line;	/* last sb line looked up by row */
+	bool search_found;		/* match_row/match_x are valid */
+	uint64_t match_row;		/* row of the current match */
+	unsigned int match_x;		/* cell of the current match */
+	uint8_t *search_buf;		/* folded text of an active line */
+	unsigned int search_buf_size;	/* allocated size of search_buf */
+	uint8_t *search_hits;		/* match marks of one line */
+	unsigned int search_hits_size;	/* allocated size of search_hits */
 };
 
 void screen_cell_init(struct tsm_screen *con, struct cell *cell);
+unsigned int screen_style_intern(struct tsm_screen *con,
+				 const struct tsm_screen_attr *attr);
+
+const struct cell *screen_line_cells(struct tsm_screen *con,
+				     const struct line *line);
+struct line *screen_sb_reflow(struct tsm_screen *con, struct line *line);
+void screen_reflow_view(struct tsm_screen *con);
+
+const uint8_t *screen_search_mark(struct tsm_screen *con, struct line *line,
+				  uint64_t row);
+void screen_search_replaced(struct tsm_screen *con, uint64_t first,
+			    uint64_t last);
+
+static inline const struct tsm_screen_attr *screen_cell_attr(
+	struct tsm_screen *con, const struct cell *cell)
+{
+	return &con->styles[cell->style];
+}
 
 void tsm_screen_set_opts(struct tsm_screen *scr, unsigned int opts);
 void tsm_screen_reset_opts(struct tsm_screen *scr, unsigned int opts);
@@ -118,6 +118,7 @@ typedef void (*tsm_log_t) (void *data,
 /* ucs4 to utf8 converter */
 
 unsigned int tsm_ucs4_get_width(uint32_t ucs4);
+size_t tsm_ucs4_get_widths(const uint32_t *ucs4, size_t len, uint8_t *widths);
 size_t tsm_ucs4_to_utf8(uint32_t ucs4, char *out);
 char *tsm_ucs4_to_utf8_alloc(const uint32_t *ucs4, size_t len, size_t *len_out);
 
@@ -170,6 +171,8 @@ struct tsm_screen_attr {
 	unsigned int inverse : 1;	/* inverse colors */
 	unsigned int protect : 1;	/* cannot be erased */
 	unsigned int blink : 1;		/* blinking character */
+	unsigned int match : 1;		/* search match (drawing only) */
+	unsigned int match_focus : 1;	/* current search match (drawing only) */
 };
 
 typedef int (*tsm_screen_draw_cb) (struct tsm_screen *con,
@@ -183,6 +186,23 @@ typedef int (*tsm_screen_draw_cb) (struct tsm_screen *con,
 				   tsm_age_t age,
 				   void *data);
 
+/* run of adjacent cells on a row that draw with the same attributes */
+struct tsm_screen_run {
+	unsigned int posx;		/* first cell of the run */
+	unsigned int posy;		/* row of the run */
+	unsigned int cells;		/* number of cells in the run */
+	const uint32_t *ch;		/* code point per cell, 0 if blank */
+	bool blank;			/* no cell of the run draws a glyph */
+	uint32_t fg;			/* foreground as 0xRRGGBB, inverse applied */
+	uint32_t bg;			/* background as 0xRRGGBB, inverse applied */
+	struct tsm_screen_attr attr;	/* resolved attributes */
+	tsm_age_t age;			/* age of the run */
+};
+
+typedef int (*tsm_screen_draw_run_cb) (struct tsm_screen *con,
+				       const struct tsm_screen_run *run,
+				       void *data);
+
 int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data);
 void tsm_screen_ref(struct tsm_screen *con);
 void tsm_screen_unref(struct tsm_screen *con);
@@ -220,6 +240,8 @@ void tsm_screen_reset_all_tabstops(struct tsm_screen *con);
 
 void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 		      const struct tsm_screen_attr *attr);
+void tsm_screen_write_run(struct tsm_screen *con, const tsm_symbol_t *ch,
+			  size_t num, const struct tsm_screen_attr *attr);
 void tsm_screen_newline(struct tsm_screen *con);
 void tsm_screen_scroll_up(struct tsm_screen *con, unsigned int num);
 void tsm_screen_scroll_down(struct tsm_screen *con, unsigned int num);
@@ -265,8 +287,16 @@ void tsm_screen_selection_word(struct tsm_screen *con,
 			       unsigned int posy);
 int tsm_screen_selection_copy(struct tsm_screen *con, char **out);
 
+int tsm_screen_search(struct tsm_screen *con, const char *needle, size_t len);
+int tsm_screen_search_next(struct tsm_screen *con, bool up);
+int tsm_screen_search_run(struct tsm_screen *con, unsigned int budget);
+bool tsm_screen_search_pending(struct tsm_screen *con);
+void tsm_screen_search_reset(struct tsm_screen *con);
+
 tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 			  void *data);
+tsm_age_t tsm_screen_draw_runs(struct tsm_screen *con,
+			       tsm_screen_draw_run_cb run_cb, void *data);
 
 /** @} */
 
@@ -41,126 +41,186 @@
 
 #define LLOG_SUBSYSTEM "tsm-render"
 
-SHL_EXPORT
-tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
-			  void *data)
-{
+/*
+ * Both iterators below walk the visible lines the same way and resolve each
+ * cell's attributes (cursor, selection, inverse mode, search hits) and age
+ * through struct render_state.
+ */
+struct render_state {
 	unsigned int cur_x, cur_y;
-	unsigned int i, j, k;
-	struct line *iter, *line = NULL;
-	struct cell *cell, empty;
-	struct tsm_screen_attr attr;
-	int ret, warned = 0;
-	const uint32_t *ch;
-	uint64_t id;
-	size_t len;
-	bool in_sel = false, sel_start = false, sel_end = false;
-	bool was_sel = false;
-	tsm_age_t age;
-
-	if (!con || !draw_cb)
-		return 0;
+	unsigned int i, k;
+	struct line *iter, *line;
+	const struct cell *cells;
+	const uint8_t *hits;
+	struct cell empty;
+	bool in_sel, sel_start, sel_end, was_sel;
+};
 
-	screen_cell_init(con, &empty);
+static void render_begin(struct tsm_screen *con, struct render_state *st)
+{
+	memset(st, 0, sizeof(*st));
+	screen_reflow_view(con);
+	screen_cell_init(con, &st->empty);
 
-	cur_x = con->cursor_x;
+	st->cur_x = con->cursor_x;
 	if (con->cursor_x >= con->size_x)
-		cur_x = con->size_x - 1;
-	cur_y = con->cursor_y;
+		st->cur_x = con->size_x - 1;
+	st->cur_y = con->cursor_y;
 	if (con->cursor_y >= con->size_y)
-		cur_y = con->size_y - 1;
-
-	/* push each character into rendering pipeline */
+		st->cur_y = con->size_y - 1;
 
-	iter = con->sb_pos;
-	k = 0;
+	st->iter = con->sb_pos;
 
 	if (con->sel_active) {
 		if (!con->sel_start.line && con->sel_start.y == SELECTION_TOP)
-			in_sel = !in_sel;
+			st->in_sel = !st->in_sel;
 		if (!con->sel_end.line && con->sel_end.y == SELECTION_TOP)
-			in_sel = !in_sel;
+			st->in_sel = !st->in_sel;
 
 		if (con->sel_start.line &&
-		    (!iter || con->sel_start.line->sb_id < iter->sb_id))
-			in_sel = !in_sel;
+		    (!st->iter || con->sel_start.line->sb_id < st->iter->sb_id))
+			st->in_sel = !st->in_sel;
 		if (con->sel_end.line &&
-		    (!iter || con->sel_end.line->sb_id < iter->sb_id))
-			in_sel = !in_sel;
+		    (!st->iter || con->sel_end.line->sb_id < st->iter->sb_id))
+			st->in_sel = !st->in_sel;
 	}
+}
 
-	for (i = 0; i < con->size_y; ++i) {
-		if (iter) {
-			line = iter;
-			iter = iter->next;
-		} else {
-			line = con->lines[k];
-			k++;
-		}
+/* advance to screen row st->i */
+static void render_line(struct tsm_screen *con, struct render_state *st)
+{
+	struct line *line;
 
-		if (con->sel_active) {
-			if (con->sel_start.line == line ||
-			    (!con->sel_start.line &&
-			     con->sel_start.y == k - 1))
-				sel_start = true;
-			else
-				sel_start = false;
-			if (con->sel_end.line == line ||
-			    (!con->sel_end.line &&
-			     con->sel_end.y == k - 1))
-				sel_end = true;
-			else
-				sel_end = false;
+	if (st->iter) {
+		line = st->iter;
+		st->iter = st->iter->next;
+	} else {
+		line = con->lines[st->k];
+		st->k++;
+	}
+	st->line = line;
+
+	if (con->sel_active) {
+		if (con->sel_start.line == line ||
+		    (!con->sel_start.line &&
+		     con->sel_start.y == st->k - 1))
+			st->sel_start = true;
+		else
+			st->sel_start = false;
+		if (con->sel_end.line == line ||
+		    (!con->sel_end.line &&
+		     con->sel_end.y == st->k - 1))
+			st->sel_end = true;
+		else
+			st->sel_end = false;
+
+		st->was_sel = false;
+	}
+
+	st->hits = screen_search_mark(con, line, line->sb_id ? :
+				      con->sb_last_id + st->k * SB_ID_STEP);
+	st->cells = screen_line_cells(con, line);
+}
+
+/* resolve cell @j of the current row into @attr and @age */
+static const struct cell *render_cell(struct tsm_screen *con,
+				      struct render_state *st, unsigned int j,
+				      struct tsm_screen_attr *attr,
+				      tsm_age_t *age)
+{
+	const struct line *line = st->line;
+	const struct cell *cell;
+
+	if (st->cells && j < line->size)
+		cell = &st->cells[j];
+	else
+		cell = &st->empty;
 
-			was_sel = false;
+	memcpy(attr, screen_cell_attr(con, cell), sizeof(*attr));
+
+	if (con->sel_active) {
+		if (st->sel_start &&
+		    j == con->sel_start.x) {
+			st->was_sel = st->in_sel;
+			st->in_sel = !st->in_sel;
 		}
+		if (st->sel_end &&
+		    j == con->sel_end.x) {
+			st->was_sel = st->in_sel;
+			st->in_sel = !st->in_sel;
+		}
+	}
 
-		for (j = 0; j < con->size_x; ++j) {
-			if (j < line->size)
-				cell = &line->cells[j];
-			else
-				cell = &empty;
-
-			memcpy(&attr, &cell->attr, sizeof(attr));
-
-			if (con->sel_active) {
-				if (sel_start &&
-				    j == con->sel_start.x) {
-					was_sel = in_sel;
-					in_sel = !in_sel;
-				}
-				if (sel_end &&
-				    j == con->sel_end.x) {
-					was_sel = in_sel;
-					in_sel = !in_sel;
-				}
-			}
+	if (st->k == st->cur_y + 1 && j == st->cur_x &&
+	    !(con->flags & TSM_SCREEN_HIDE_CURSOR))
+		attr->inverse = !attr->inverse;
 
-			if (k == cur_y + 1 && j == cur_x &&
-			    !(con->flags & TSM_SCREEN_HIDE_CURSOR))
-				attr.inverse = !attr.inverse;
+	/* TODO: do some more sophisticated inverse here. When
+	 * INVERSE mode is set, we should instead just select
+	 * inverse colors instead of switching background and
+	 * foreground */
+	if (con->flags & TSM_SCREEN_INVERSE)
+		attr->inverse = !attr->inverse;
 
-			/* TODO: do some more sophisticated inverse here. When
-			 * INVERSE mode is set, we should instead just select
-			 * inverse colors instead of switching background and
-			 * foreground */
-			if (con->flags & TSM_SCREEN_INVERSE)
-				attr.inverse = !attr.inverse;
+	if (st->in_sel || st->was_sel) {
+		st->was_sel = false;
+		attr->inverse = !attr->inverse;
+	}
 
-			if (in_sel || was_sel) {
-				was_sel = false;
-				attr.inverse = !attr.inverse;
-			}
+	if (st->hits && j < line->size && st->hits[j]) {
+		attr->match = 1;
+		attr->match_focus = st->hits[j] == 2;
+	}
 
-			if (con->age_reset) {
-				age = 0;
-			} else {
-				age = cell->age;
-				if (line->age > age)
-					age = line->age;
-				if (con->age > age)
-					age = con->age;
-			}
+	if (con->age_reset) {
+		*age = 0;
+	} else if (cell == &st->empty) {
+		*age = con->age_cnt;
+	} else {
+		*age = line->age;
+		if (con->age > *age)
+			*age = con->age;
+	}
+
+	return cell;
+}
+
+static tsm_age_t render_end(struct tsm_screen *con)
+{
+	if (con->age_reset) {
+		con->age_reset = 0;
+		return 0;
+	} else {
+		return con->age_cnt;
+	}
+}
+
+SHL_EXPORT
+tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
+			  void *data)
+{
+	struct render_state st;
+	unsigned int j;
+	const struct cell *cell;
+	struct tsm_screen_attr attr;
+	int ret, warned = 0;
+	const uint32_t *ch;
+	uint64_t id;
+	size_t len;
+	tsm_age_t age;
+
+	if (!con || !draw_cb)
+		return 0;
+
+	render_begin(con, &st);
+
+	/* push each character into rendering pipeline */
+
+	for (st.i = 0; st.i < con->size_y; ++st.i) {
+		render_line(con, &st);
+
+		for (j = 0; j < con->size_x; ++j) {
+			cell = render_cell(con, &st, j, &attr, &age);
 
 			/* Encode attributes into the id to avoid caching problems */
 			id = cell->ch;
@@ -174,16 +234,20 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 				id |= 1ULL << (TSM_UCS4_MAX_BITS + 3);
 			if (attr.blink)
 				id |= 1ULL << (TSM_UCS4_MAX_BITS + 4);
+			if (attr.match)
+				id |= 1ULL << (TSM_UCS4_MAX_BITS + 5);
+			if (attr.match_focus)
+				id |= 1ULL << (TSM_UCS4_MAX_BITS + 6);
 
 			ch = tsm_symbol_get(con->sym_table, &cell->ch, &len);
 			if (cell->ch == 0 || (cell->ch == ' ' && !attr.underline))
 				len = 0;
 			ret = draw_cb(con, id, ch, len, cell->width,
-				      j, i, &attr, age, data);
+				      j, st.i, &attr, age, data);
 			if (ret && warned++ < 3) {
 				llog_debug(con,
 					   "cannot draw glyph at %ux%u via text-renderer",
-					   j, i);
+					   j, st.i);
 				if (warned == 3)
 					llog_debug(con,
 						   "suppressing further warnings during this rendering round");
@@ -191,10 +255,118 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 		}
 	}
 
-	if (con->age_reset) {
-		con->age_reset = 0;
+	return render_end(con);
+}
+
+/* attribute bits that split runs besides colors and age */
+static unsigned int run_flags(const struct tsm_screen_attr *attr)
+{
+	return attr->bold | attr->italic << 1 | attr->underline << 2 |
+	       attr->inverse << 3 | attr->blink << 4 | attr->match << 5 |
+	       attr->match_focus << 6;
+}
+
+static void run_emit(struct tsm_screen *con, const struct tsm_screen_run *run,
+		     tsm_screen_draw_run_cb run_cb, void *data, int *warned)
+{
+	int ret;
+
+	ret = run_cb(con, run, data);
+	if (ret && (*warned)++ < 3) {
+		llog_debug(con, "cannot draw run at %ux%u via text-renderer",
+			   run->posx, run->posy);
+		if (*warned == 3)
+			llog_debug(con,
+				   "suppressing further warnings during this rendering round");
+	}
+}
+
+/*
+ * Like tsm_screen_draw() but hands out runs of adjacent cells on a row that
+ * resolve to the same colors, attributes and age. Colors are the RGB values
+ * of the attributes with inverse applied, so a renderer can fill the
+ * background of a whole run at once and skip the glyphs of blank runs.
+ * run->ch holds one code point per cell: the base character of its symbol,
+ * or 0 for cells that draw nothing (empty, space without underline, right
+ * half of a wide character).
+ */
+SHL_EXPORT
+tsm_age_t tsm_screen_draw_runs(struct tsm_screen *con,
+			       tsm_screen_draw_run_cb run_cb, void *data)
+{
+	struct render_state st;
+	struct tsm_screen_run run;
+	struct tsm_screen_attr attr;
+	const struct cell *cell;
+	const uint32_t *ch;
+	unsigned int j, flags, run_flag = 0;
+	uint32_t fg, bg, tmp, *buf;
+	size_t len;
+	tsm_age_t age;
+	int warned = 0;
+
+	if (!con || !run_cb)
 		return 0;
-	} else {
-		return con->age_cnt;
+
+	if (con->run_size < con->size_x) {
+		buf = realloc(con->run_buf, sizeof(*buf) * con->size_x);
+		if (!buf)
+			return 0;
+		con->run_buf = buf;
+		con->run_size = con->size_x;
+	}
+	buf = con->run_buf;
+
+	render_begin(con, &st);
+
+	for (st.i = 0; st.i < con->size_y; ++st.i) {
+		render_line(con, &st);
+		run.cells = 0;
+
+		for (j = 0; j < con->size_x; ++j) {
+			cell = render_cell(con, &st, j, &attr, &age);
+
+			fg = attr.fr << 16 | attr.fg << 8 | attr.fb;
+			bg = attr.br << 16 | attr.bg << 8 | attr.bb;
+			if (attr.inverse) {
+				tmp = fg;
+				fg = bg;
+				bg = tmp;
+			}
+			flags = run_flags(&attr);
+
+			ch = tsm_symbol_get(con->sym_table, &cell->ch, &len);
+			if (!len || cell->ch == 0 ||
+			    (cell->ch == ' ' && !attr.underline))
+				buf[j] = 0;
+			else
+				buf[j] = ch[0];
+
+			if (run.cells && (run.fg != fg || run.bg != bg ||
+					  run.age != age || run_flag != flags)) {
+				run_emit(con, &run, run_cb, data, &warned);
+				run.cells = 0;
+			}
+
+			if (!run.cells) {
+				run.posx = j;
+				run.posy = st.i;
+				run.ch = &buf[j];
+				run.blank = true;
+				run.fg = fg;
+				run.bg = bg;
+				run.age = age;
+				memcpy(&run.attr, &attr, sizeof(attr));
+				run_flag = flags;
+			}
+			++run.cells;
+			if (buf[j])
+				run.blank = false;
+		}
+
+		if (run.cells)
+			run_emit(con, &run, run_cb, data, &warned);
 	}
+
+	return render_end(con);
 }
@@ -44,10 +44,10 @@
  * they need.
  *
  * AGEING:
- * Each cell, line and screen has an "age" field. This field describes when it
- * was changed the last time. After drawing a screen, the current screen age is
+ * Each line and screen has an "age" field. This field describes when it was
+ * changed the last time. After drawing a screen, the current screen age is
  * returned. This allows users to skip drawing specific cells, if their
- * framebuffer was already drawn with a newer age than a given cell.
+ * framebuffer was already drawn with a newer age than the cell's line.
  * However, the screen-age might overflow. This is properly detected and causes
  * drawing functions to return "0" as age. Users must reset all their
  * framebuffer ages then. Otherwise, further drawing operations might
@@ -67,24 +67,443 @@
 
 #define LLOG_SUBSYSTEM "tsm-screen"
 
-static struct cell *get_cursor_cell(struct tsm_screen *con)
+/*
+ * Scrollback Packing
+ * Scrollback lines that scrolled further than SB_HOT_LINES past the screen
+ * are rarely looked at again, yet a full-width cell array costs 8 bytes per
+ * column. Such lines are re-encoded into a byte string and their cells are
+ * freed. Consumers go through screen_line_cells(), which decodes a packed
+ * line into a per-screen scratch array on demand.
+ * Packed buffers travel with lines through the line pool, so once the
+ * scrollback buffer is full, packing reuses the buffer of the line just
+ * evicted instead of allocating. A buffer is sized to its own encoding
+ * rounded up to a power of two. A reused buffer that is too small is
+ * grown to that size, and one over four times that size is shrunk to it,
+ * so a single long line can't inflate the buffers of every later line.
+ * The encoding is:
+ *   uint32 style of the trimmed trailing blanks
+ *   varint number of stored cells; trailing blanks are not stored
+ *   runs of cells sharing style and width, each made of:
+ *     varint cell count, uint32 style, uint8 width, one varint per symbol
+ * Varints are LEB128, so plain ASCII costs one byte per cell. Styles are
+ * stored unencoded so the style collector can rewrite them in place.
+ */
+
+#define SB_HOT_LINES 256
+
+static uint8_t *varint_put(uint8_t *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const uint8_t *varint_get(const uint8_t *p, uint32_t *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	do {
+		*v |= (uint32_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+
+	return p;
+}
+
+static bool cell_same_run(const struct cell *a, const struct cell *b)
+{
+	return (a->style == b->style) & (a->width == b->width);
+}
+
+static void line_pack(struct tsm_screen *con, struct line *line)
+{
+	const struct cell *cells = line->cells, *last;
+	unsigned int n, i, j;
+	uint8_t *buf, *p, *packed;
+	struct line *pool;
+	uint32_t style;
+	size_t size, cap, want;
+
+	if (!line->size || !cells || line->packed)
+		return;
+
+	/* trailing blanks are all identical to the last cell, if it's blank */
+	n = line->size;
+	last = &cells[n - 1];
+	if (!last->ch && last->width == 1) {
+		while (n > 0 && !memcmp(&cells[n - 1], last, sizeof(*last)))
+			--n;
+	}
+
+	/* encode into a scratch buffer sized for the worst case of one run
+	 * per cell with a 5 byte symbol, then copy out the exact size */
+	size = 4 + 5 + (size_t)n * (5 + 4 + 1 + 5);
+	if (con->pack_buf_size < size) {
+		buf = realloc(con->pack_buf, size);
+		if (!buf)
+			return;
+		con->pack_buf = buf;
+		con->pack_buf_size = size;
+	}
+	buf = con->pack_buf;
+
+	p = buf;
+	style = last->style;
+	memcpy(p, &style, 4);
+	p = varint_put(p + 4, n);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && cell_same_run(&cells[i], &cells[j]); ++j)
+			;
+
+		p = varint_put(p, j - i);
+		style = cells[i].style;
+		memcpy(p, &style, 4);
+		p += 4;
+		*p++ = cells[i].width;
+		for ( ; i < j; ++i) {
+			if (cells[i].ch < 0x80)
+				*p++ = cells[i].ch;
+			else
+				p = varint_put(p, cells[i].ch);
+		}
+	}
+
+	/* At steady state the line just evicted from the scrollback buffer
+	 * sits in the pool with its packed buffer and without cells: take
+	 * the buffer, resizing it if it is too small or far too large, and
+	 * hand it our cells. */
+	size = p - buf;
+	for (want = 16; want < size; want *= 2)
+		;
+	pool = con->line_pool;
+	if (pool && pool->packed) {
+		packed = pool->packed;
+		cap = pool->packed_size;
+	} else {
+		packed = NULL;
+		cap = 0;
+	}
+	if (cap < size || cap > 4 * want) {
+		packed = realloc(packed, want);
+		if (!packed)
+			return;
+		cap = want;
+	}
+	if (pool && pool->packed) {
+		pool->packed = NULL;
+		pool->packed_size = 0;
+	}
+	memcpy(packed, buf, size);
+	line->packed = packed;
+	line->packed_size = cap;
+
+	if (pool && !pool->cells) {
+		pool->cells = line->cells;
+		pool->size = line->size;
+	} else {
+		free(line->cells);
+	}
+	line->cells = NULL;
+}
+
+/* call @cb on the address of every style index stored in a packed line */
+static void packed_foreach_style(uint8_t *p,
+				 void (*cb)(uint8_t *style, void *data),
+				 void *data)
+{
+	uint32_t n, count, ch, i;
+
+	cb(p, data);
+	p = (uint8_t *)varint_get(p + 4, &n);
+
+	while (n) {
+		p = (uint8_t *)varint_get(p, &count);
+		cb(p, data);
+		p += 5;
+		for (i = 0; i < count; ++i)
+			p = (uint8_t *)varint_get(p, &ch);
+		n -= count;
+	}
+}
+
+const struct cell *screen_line_cells(struct tsm_screen *con,
+				     const struct line *line)
+{
+	const uint8_t *p;
+	struct cell *cells;
+	uint32_t n, count, style, width, ch, i;
+	unsigned int pos = 0;
+
+	if (!line->packed)
+		return line->cells;
+
+	if (con->unpacked_size < line->size) {
+		cells = realloc(con->unpacked, sizeof(*cells) * line->size);
+		if (!cells)
+			return NULL;
+		con->unpacked = cells;
+		con->unpacked_size = line->size;
+	}
+	cells = con->unpacked;
+
+	p = line->packed;
+	p = varint_get(p + 4, &n);
+	while (pos < n) {
+		p = varint_get(p, &count);
+		memcpy(&style, p, 4);
+		width = p[4];
+		p += 5;
+		for (i = 0; i < count; ++i, ++pos) {
+			p = varint_get(p, &ch);
+			cells[pos].ch = ch;
+			cells[pos].style = style;
+			cells[pos].width = width;
+		}
+	}
+
+	memcpy(&style, line->packed, 4);
+	for ( ; pos < line->size; ++pos) {
+		cells[pos].ch = 0;
+		cells[pos].style = style;
+		cells[pos].width = 1;
+	}
+
+	return cells;
+}
+
+/*
+ * Style Table
+ * Cells do not store their attributes but an index into a per-screen table
+ * of distinct attributes. Terminals use a handful of styles at a time, so
+ * the table stays tiny while each cell shrinks to 8 bytes. Lookups go through
+ * an open-addressed hash index, with the last interned style checked first as
+ * consecutive writes almost always share attributes.
+ * Styles are never freed individually. Once the table reaches style_limit,
+ * screen_style_collect() drops all styles no longer referenced by any cell
+ * and renumbers the rest. It rewrites cells, so it only runs at the start of
+ * the write functions where no style index is held by the caller.
+ */
+
+#define STYLE_MIN_LIMIT 4096
+
+static uint64_t style_key(const struct tsm_screen_attr *attr)
+{
+	return (uint64_t)(uint8_t)attr->fccode |
+	       (uint64_t)(uint8_t)attr->bccode << 8 |
+	       (uint64_t)attr->fr << 16 | (uint64_t)attr->fg << 24 |
+	       (uint64_t)attr->fb << 32 | (uint64_t)attr->br << 40 |
+	       (uint64_t)attr->bg << 48 | (uint64_t)attr->bb << 56;
+}
+
+static unsigned int style_flags(const struct tsm_screen_attr *attr)
+{
+	return attr->bold | attr->italic << 1 | attr->underline << 2 |
+	       attr->inverse << 3 | attr->protect << 4 | attr->blink << 5;
+}
+
+static bool style_equal(const struct tsm_screen_attr *a,
+			const struct tsm_screen_attr *b)
+{
+	return style_key(a) == style_key(b) &&
+	       style_flags(a) == style_flags(b);
+}
+
+static unsigned int style_hash(const struct tsm_screen_attr *attr)
+{
+	uint64_t h;
+
+	h = (style_key(attr) ^ style_flags(attr)) * 0x9e3779b97f4a7c15ULL;
+	return (unsigned int)(h >> 32);
+}
+
+static void style_index_insert(struct tsm_screen *con, unsigned int style)
+{
+	unsigned int mask = con->style_index_size - 1;
+	unsigned int i = style_hash(&con->styles[style]) & mask;
+
+	while (con->style_index[i])
+		i = (i + 1) & mask;
+	con->style_index[i] = style + 1;
+}
+
+static int style_index_rebuild(struct tsm_screen *con, unsigned int size)
+{
+	uint32_t *index;
+	unsigned int i;
+
+	index = calloc(size, sizeof(*index));
+	if (!index)
+		return -ENOMEM;
+
+	free(con->style_index);
+	con->style_index = index;
+	con->style_index_size = size;
+	for (i = 0; i < con->style_num; ++i)
+		style_index_insert(con, i);
+
+	return 0;
+}
+
+unsigned int screen_style_intern(struct tsm_screen *con,
+				 const struct tsm_screen_attr *attr)
 {
-	unsigned int cur_x, cur_y;
+	struct tsm_screen_attr *styles;
+	unsigned int i, mask, style, size;
+
+	if (con->style_num &&
+	    style_equal(&con->styles[con->style_last], attr))
+		return con->style_last;
+
+	if (con->style_index_size) {
+		mask = con->style_index_size - 1;
+		for (i = style_hash(attr) & mask; con->style_index[i];
+		     i = (i + 1) & mask) {
+			style = con->style_index[i] - 1;
+			if (style_equal(&con->styles[style], attr)) {
+				con->style_last = style;
+				return style;
+			}
+		}
+	}
+
+	if (con->style_num >= con->style_size) {
+		size = con->style_size ? con->style_size * 2 : 16;
+		styles = realloc(con->styles, size * sizeof(*styles));
+		if (!styles) {
+			llog_warning(con, "cannot grow style table");
+			return con->style_num ? con->style_last : 0;
+		}
+		con->styles = styles;
+		con->style_size = size;
+	}
 
-	cur_x = con->cursor_x;
-	if (cur_x >= con->size_x)
-		cur_x = con->size_x - 1;
+	/* keep the index at most half full */
+	if ((con->style_num + 1) * 2 > con->style_index_size) {
+		size = con->style_index_size ? con->style_index_size * 2 : 32;
+		if (style_index_rebuild(con, size)) {
+			llog_warning(con, "cannot grow style index");
+			return con->style_num ? con->style_last : 0;
+		}
+	}
+
+	style = con->style_num++;
+	memcpy(&con->styles[style], attr, sizeof(*attr));
+	style_index_insert(con, style);
+	con->style_last = style;
+	return style;
+}
+
+static void style_mark_packed(uint8_t *p, void *data)
+{
+	uint32_t *map = data;
+	uint32_t style;
+
+	memcpy(&style, p, 4);
+	map[style] = 1;
+}
+
+static void style_remap_packed(uint8_t *p, void *data)
+{
+	const uint32_t *map = data;
+	uint32_t style;
+
+	memcpy(&style, p, 4);
+	memcpy(p, &map[style], 4);
+}
+
+static void style_mark_line(const struct line *line, uint32_t *map)
+{
+	unsigned int i;
+
+	if (line->packed) {
+		packed_foreach_style(line->packed, style_mark_packed, map);
+		return;
+	}
+
+	for (i = 0; i < line->size; ++i)
+		map[line->cells[i].style] = 1;
+}
+
+static void style_remap_line(struct line *line, uint32_t *map)
+{
+	unsigned int i;
+
+	if (line->packed) {
+		packed_foreach_style(line->packed, style_remap_packed, map);
+		return;
+	}
+
+	for (i = 0; i < line->size; ++i)
+		line->cells[i].style = map[line->cells[i].style];
+}
+
+static void screen_style_collect(struct tsm_screen *con)
+{
+	uint32_t *map;
+	struct line *iter;
+	unsigned int i, num = 0;
+
+	map = calloc(con->style_num, sizeof(*map));
+	if (!map)
+		return;
+
+	for (i = 0; i < con->line_num; ++i) {
+		style_mark_line(con->main_lines[i], map);
+		style_mark_line(con->alt_lines[i], map);
+	}
+	for (iter = con->sb_first; iter; iter = iter->next)
+		style_mark_line(iter, map);
+
+	for (i = 0; i < con->style_num; ++i) {
+		if (!map[i])
+			continue;
+		if (num != i)
+			memcpy(&con->styles[num], &con->styles[i],
+			       sizeof(con->styles[i]));
+		map[i] = num++;
+	}
+
+	for (i = 0; i < con->line_num; ++i) {
+		style_remap_line(con->main_lines[i], map);
+		style_remap_line(con->alt_lines[i], map);
+	}
+	for (iter = con->sb_first; iter; iter = iter->next)
+		style_remap_line(iter, map);
+
+	con->style_num = num;
+	con->style_last = 0;
+	style_index_rebuild(con, con->style_index_size);
+	free(map);
+
+	/* mostly live styles: collecting again soon would be wasted work */
+	if (num * 2 > con->style_limit)
+		con->style_limit *= 2;
+}
+
+static inline void screen_style_maybe_collect(struct tsm_screen *con)
+{
+	if (con->style_num >= con->style_limit)
+		screen_style_collect(con);
+}
+
+static struct line *get_cursor_line(struct tsm_screen *con)
+{
+	unsigned int cur_y;
 
 	cur_y = con->cursor_y;
 	if (cur_y >= con->size_y)
 		cur_y = con->size_y - 1;
 
-	return &con->lines[cur_y]->cells[cur_x];
+	return con->lines[cur_y];
 }
 
 static void move_cursor(struct tsm_screen *con, unsigned int x, unsigned int y)
 {
-	struct cell *c;
 
 	/* if cursor is hidden, just move it */
 	if (con->flags & TSM_SCREEN_HIDE_CURSOR) {
@@ -93,62 +512,105 @@ static void move_cursor(struct tsm_screen *con, unsigned int x, unsigned int y)
 		return;
 	}
 
-	/* If cursor is visible, we have to mark the current and the new cell
+	/* If cursor is visible, we have to mark the current and the new line
 	 * as changed by resetting their age. We skip it if the cursor-position
 	 * didn't actually change. */
 
 	if (con->cursor_x == x && con->cursor_y == y)
 		return;
 
-	c = get_cursor_cell(con);
-	c->age = con->age_cnt;
+	get_cursor_line(con)->age = con->age_cnt;
 
 	con->cursor_x = x;
 	con->cursor_y = y;
 
-	c = get_cursor_cell(con);
-	c->age = con->age_cnt;
+	get_cursor_line(con)->age = con->age_cnt;
 }
 
-void screen_cell_init_generic(struct tsm_screen *con, struct cell *cell, struct tsm_screen_attr *attr)
+static inline void screen_cell_init_style(struct cell *cell,
+					  unsigned int style)
 {
 	cell->ch = 0;
 	cell->width = 1;
-	cell->age = con->age_cnt;
+	cell->style = style;
+}
+
+/* reset @num cells starting at @cells to blanks with the default attributes */
+static void screen_cells_init(struct tsm_screen *con, struct cell *cells,
+			      unsigned int num)
+{
+	unsigned int i, style;
 
-	memcpy(&cell->attr, attr, sizeof(cell->attr));
+	style = screen_style_intern(con, &con->def_attr);
+	for (i = 0; i < num; ++i)
+		screen_cell_init_style(&cells[i], style);
 }
 
 void screen_cell_init(struct tsm_screen *con, struct cell *cell)
 {
-	screen_cell_init_generic(con, cell, &con->def_attr);
+	screen_cell_init_style(cell, screen_style_intern(con, &con->def_attr));
 }
 
+/*
+ * Line Pool
+ * Once the scrollback buffer is full, every line scrolled into it evicts the
+ * oldest one. Instead of freeing evicted lines, they are kept on a small
+ * per-screen free list and handed out again by line_new(), so a terminal
+ * scrolling at steady state does not touch the heap at all. Pooled lines
+ * keep their packed buffer for line_pack() to take over. The pool is
+ * bounded so clearing a large scrollback buffer still returns its memory.
+ */
+
+#define LINE_POOL_MAX 128
+
 static int line_new(struct tsm_screen *con, struct line **out,
 		    unsigned int width)
 {
 	struct line *line;
-	unsigned int i;
+	struct cell *cells;
 
 	if (!width)
 		return -EINVAL;
 
-	line = malloc(sizeof(*line));
-	if (!line)
-		return -ENOMEM;
+	line = con->line_pool;
+	if (line) {
+		if (!line->cells || line->size != width) {
+			cells = realloc(line->cells,
+					sizeof(struct cell) * width);
+			if (!cells)
+				return -ENOMEM;
+			line->cells = cells;
+		}
+		con->line_pool = line->next;
+		--con->line_pool_num;
+		/* not taken by line_pack(), live lines must not have one */
+		free(line->packed);
+		line->packed = NULL;
+		line->packed_size = 0;
+	} else {
+		line = malloc(sizeof(*line));
+		if (!line)
+			return -ENOMEM;
+
+		line->cells = malloc(sizeof(struct cell) * width);
+		if (!line->cells) {
+			free(line);
+			return -ENOMEM;
+		}
+		line->packed = NULL;
+		line->packed_size = 0;
+		line->text = NULL;
+	}
+
 	line->next = NULL;
 	line->prev = NULL;
 	line->size = width;
 	line->age = con->age_cnt;
+	line->sb_id = 0;
+	line->wrap = 0;
+	line->cols = 0;
 
-	line->cells = malloc(sizeof(struct cell) * width);
-	if (!line->cells) {
-		free(line);
-		return -ENOMEM;
-	}
-
-	for (i = 0; i < width; ++i)
-		screen_cell_init(con, &line->cells[i]);
+	screen_cells_init(con, line->cells, width);
 
 	*out = line;
 	return 0;
@@ -156,10 +618,43 @@ static int line_new(struct tsm_screen *con, struct line **out,
 
 static void line_free(struct line *line)
 {
+	free(line->text);
+	free(line->packed);
 	free(line->cells);
 	free(line);
 }
 
+/* return @line to the pool of @con, or free it if the pool is full */
+static void line_recycle(struct tsm_screen *con, struct line *line)
+{
+	if (con->search_line == line)
+		con->search_line = NULL;
+
+	if (con->line_pool_num >= LINE_POOL_MAX) {
+		line_free(line);
+		return;
+	}
+
+	free(line->text);
+	line->text = NULL;
+	line->prev = NULL;
+	line->next = con->line_pool;
+	con->line_pool = line;
+	++con->line_pool_num;
+}
+
+static void line_pool_clear(struct tsm_screen *con)
+{
+	struct line *tmp;
+
+	while (con->line_pool) {
+		tmp = con->line_pool;
+		con->line_pool = tmp->next;
+		line_free(tmp);
+	}
+	con->line_pool_num = 0;
+}
+
 static int line_resize(struct tsm_screen *con, struct line *line,
 		       unsigned int width)
 {
@@ -175,20 +670,95 @@ static int line_resize(struct tsm_screen *con, struct line *line,
 
 		line->cells = tmp;
 
-		while (line->size < width) {
-			screen_cell_init(con, &line->cells[line->size]);
-			++line->size;
-		}
+		screen_cells_init(con, &line->cells[line->size],
+				  width - line->size);
+		line->size = width;
+		line->age = con->age_cnt;
 	}
 
 	return 0;
 }
 
 /* This links the given line into the scrollback-buffer */
-static void link_to_scrollback(struct tsm_screen *con, struct line *line)
+/*
+ * Remove the top-most line of the scrollback buffer. We must take care to
+ * correctly keep the current position as @line is linked in after the
+ * top-most line is removed; @line is the line the position moves to when
+ * nothing follows the removed line. Without @line nothing is linked in and
+ * the position stays on its line, as in tsm_screen_set_max_sb().
+ */
+static void sb_drop_first(struct tsm_screen *con, struct line *line)
 {
 	struct line *tmp;
 
+	tmp = con->sb_first;
+	con->sb_first = tmp->next;
+	if (tmp->next)
+		tmp->next->prev = NULL;
+	else
+		con->sb_last = NULL;
+	--con->sb_count;
+
+	if (con->sb_hot == tmp) {
+		con->sb_hot = tmp->next;
+		--con->sb_hot_num;
+	}
+
+	/* (position == tmp && !next) means we have sb_max=1 so set
+	 * position to the new line. Otherwise, set to new first line.
+	 * If position!=tmp and we have a fixed-position then nothing
+	 * needs to be done because we can stay at the same line. If we
+	 * have no fixed-position, we need to set the position to the
+	 * next inserted line, which can be "line", too. */
+	if (!line) {
+		if (con->sb_pos == tmp)
+			con->sb_pos = con->sb_first;
+		else
+			--con->sb_pos_num;
+	} else if (con->sb_pos) {
+		if (con->sb_pos == tmp ||
+		    !(con->flags & TSM_SCREEN_FIXED_POS)) {
+			if (con->sb_pos->next) {
+				con->sb_pos = con->sb_pos->next;
+				++con->sb_pos_num;
+			} else {
+				con->sb_pos = line;
+				con->sb_pos_num = 0;
+			}
+		}
+	}
+
+	if (con->sel_active) {
+		if (con->sel_start.line == tmp) {
+			con->sel_start.line = NULL;
+			con->sel_start.y = SELECTION_TOP;
+		}
+		if (con->sel_end.line == tmp) {
+			con->sel_end.line = NULL;
+			con->sel_end.y = SELECTION_TOP;
+		}
+	}
+	line_recycle(con, tmp);
+}
+
+/*
+ * Rewrapping scrollback lines to a narrower width adds lines. Drop the oldest
+ * ones until the buffer is back within sb_max. Callers of screen_sb_reflow()
+ * run this once they are done with the lines it returned. Returns true if the
+ * position moved because its line was dropped.
+ */
+static bool screen_sb_trim(struct tsm_screen *con)
+{
+	struct line *pos = con->sb_pos;
+
+	while (con->sb_count > con->sb_max)
+		sb_drop_first(con, NULL);
+
+	return con->sb_pos != pos;
+}
+
+static void link_to_scrollback(struct tsm_screen *con, struct line *line)
+{
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
 
@@ -203,57 +773,20 @@ static void link_to_scrollback(struct tsm_screen *con, struct line *line)
 				con->sel_end.y = SELECTION_TOP;
 			}
 		}
-		line_free(line);
+		line_recycle(con, line);
 		return;
 	}
 
-	/* Remove a line from the scrollback buffer if it reaches its maximum.
-	 * We must take care to correctly keep the current position as the new
-	 * line is linked in after we remove the top-most line here.
+	/* Remove lines from the scrollback buffer if it reaches its maximum.
 	 * sb_max == 0 is tested earlier so we can assume sb_max > 0 here. In
-	 * other words, buf->sb_first is a valid line if sb_count >= sb_max. */
-	if (con->sb_count >= con->sb_max) {
-		tmp = con->sb_first;
-		con->sb_first = tmp->next;
-		if (tmp->next)
-			tmp->next->prev = NULL;
-		else
-			con->sb_last = NULL;
-		--con->sb_count;
-
-		/* (position == tmp && !next) means we have sb_max=1 so set
-		 * position to the new line. Otherwise, set to new first line.
-		 * If position!=tmp and we have a fixed-position then nothing
-		 * needs to be done because we can stay at the same line. If we
-		 * have no fixed-position, we need to set the position to the
-		 * next inserted line, which can be "line", too. */
-		if (con->sb_pos) {
-			if (con->sb_pos == tmp ||
-			    !(con->flags & TSM_SCREEN_FIXED_POS)) {
-				if (con->sb_pos->next) {
-					con->sb_pos = con->sb_pos->next;
-					++con->sb_pos_num;
-				} else {
-					con->sb_pos = line;
-					con->sb_pos_num = 0;
-				}
-			}
-		}
-
-		if (con->sel_active) {
-			if (con->sel_start.line == tmp) {
-				con->sel_start.line = NULL;
-				con->sel_start.y = SELECTION_TOP;
-			}
-			if (con->sel_end.line == tmp) {
-				con->sel_end.line = NULL;
-				con->sel_end.y = SELECTION_TOP;
-			}
-		}
-		line_free(tmp);
-	}
-
-	line->sb_id = ++con->sb_last_id;
+	 * other words, buf->sb_first is a valid line if sb_count >= sb_max.
+	 * More than one line is dropped when a reflow left the buffer over
+	 * its maximum. */
+	while (con->sb_count >= con->sb_max)
+		sb_drop_first(con, line);
+
+	con->sb_last_id += SB_ID_STEP;
+	line->sb_id = con->sb_last_id;
 	line->next = NULL;
 	line->prev = con->sb_last;
 	if (con->sb_last) {
@@ -267,11 +800,397 @@ static void link_to_scrollback(struct tsm_screen *con, struct line *line)
 	if (con->sb_pos == NULL) {
 		con->sb_pos_num = con->sb_count;
 	}
+
+	if (!con->sb_hot)
+		con->sb_hot = line;
+	if (++con->sb_hot_num > SB_HOT_LINES) {
+		line_pack(con, con->sb_hot);
+		con->sb_hot = con->sb_hot->next;
+		--con->sb_hot_num;
+	}
+}
+
+/*
+ * Reflow
+ * Lines remember whether their text continued on the next line when they
+ * were written (line->wrap holds the number of cells carried over), so a
+ * width change can rewrap logical lines instead of truncating them.
+ * tsm_screen_resize() rewraps the main screen right away. Scrollback lines
+ * are rewrapped lazily: each one records the width it is laid out for and
+ * screen_sb_reflow() is only run on lines about to be shown, so resizing a
+ * huge scrollback buffer costs nothing until the user scrolls through it.
+ * Rewrapped lines are numbered within the id range of the lines they
+ * replace, which is why sb ids are SB_ID_STEP apart.
+ * The text of a logical line is collected in reflow_buf without the
+ * continuation cells of wide characters, which are recreated on layout.
+ */
+
+/* number of cells up to and including the last non-blank one */
+static unsigned int cells_used(const struct cell *cells, unsigned int num)
+{
+	while (num && !cells[num - 1].ch && cells[num - 1].width == 1)
+		--num;
+
+	return num;
+}
+
+/* append the first @num cells of @cells to the reflow buffer at @len */
+static int reflow_gather(struct tsm_screen *con, const struct cell *cells,
+			 unsigned int num, unsigned int *len)
+{
+	struct cell *buf;
+	unsigned int i, size;
+
+	if (con->reflow_size < *len + num) {
+		size = con->reflow_size ? con->reflow_size : 256;
+		while (size < *len + num)
+			size *= 2;
+		buf = realloc(con->reflow_buf, sizeof(*buf) * size);
+		if (!buf)
+			return -ENOMEM;
+		con->reflow_buf = buf;
+		con->reflow_size = size;
+	}
+
+	for (i = 0; i < num; ++i) {
+		if (cells[i].width)
+			con->reflow_buf[(*len)++] = cells[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Lay out the reflow buffer from *@pos on @line until @width is full. Wide
+ * characters that do not fit are moved to the next line. Returns the number
+ * of cells used and sets line->wrap if text is left.
+ */
+static unsigned int reflow_fill(struct tsm_screen *con, struct line *line,
+				unsigned int width, unsigned int *pos,
+				unsigned int len)
+{
+	const struct cell *c;
+	unsigned int x = 0;
+
+	while (*pos < len) {
+		c = &con->reflow_buf[*pos];
+		if (x && x + c->width > width)
+			break;
+
+		line->cells[x] = *c;
+		if (c->width > 1 && x + 1 < width) {
+			line->cells[x + 1].ch = 0;
+			line->cells[x + 1].width = 0;
+			line->cells[x + 1].style = c->style;
+		}
+		x += c->width;
+		++*pos;
+	}
+
+	if (x > width)
+		x = width;
+	line->wrap = *pos < len ? x : 0;
+	return x;
+}
+
+/*
+ * Rewrap the main screen for @width. Logical lines are collected from the
+ * top down to the cursor or the last non-blank line and laid out on new
+ * lines. If they need more rows than the screen has, the top rows are pushed
+ * into the scrollback buffer as long as the cursor stays on the screen.
+ * Nothing is changed if memory runs out.
+ */
+static int screen_reflow(struct tsm_screen *con, unsigned int width)
+{
+	struct line **lines = con->main_lines, **out = NULL, **tmp;
+	const struct cell *cells;
+	unsigned int y, last, num, x, i, e, len = 0, pos = 0;
+	unsigned int cur = 0, cur_line = 0, cur_x = 0, cur_y = 0;
+	unsigned int *ends, nends = 0, rows = 0, size = 0, push;
+	uint64_t sb_id = con->sb_last_id;
+	int ret = -ENOMEM;
+
+	ends = malloc(sizeof(*ends) * con->size_y);
+	if (!ends)
+		return -ENOMEM;
+
+	last = con->cursor_y;
+	for (y = last + 1; y < con->size_y; ++y) {
+		if (lines[y]->wrap ||
+		    cells_used(lines[y]->cells, lines[y]->size))
+			last = y;
+	}
+
+	for (y = 0; y <= last; ++y) {
+		cells = lines[y]->cells;
+		if (lines[y]->wrap && y < last)
+			num = lines[y]->wrap;
+		else
+			num = cells_used(cells, lines[y]->size);
+		if (num > lines[y]->size)
+			num = lines[y]->size;
+
+		/* the cursor may sit behind the text, keep its position */
+		if (y == con->cursor_y) {
+			x = con->cursor_x;
+			if (x > lines[y]->size)
+				x = lines[y]->size;
+			if (num < x)
+				num = x;
+			cur = len;
+			for (i = 0; i < x; ++i)
+				cur += !!cells[i].width;
+			cur_line = nends;
+		}
+
+		if (reflow_gather(con, cells, num, &len))
+			goto out;
+		if (!lines[y]->wrap || y == last)
+			ends[nends++] = len;
+	}
+
+	for (e = 0; e < nends; ++e) {
+		do {
+			if (rows >= size) {
+				size = size ? size * 2 : con->size_y;
+				tmp = realloc(out, sizeof(*out) * size);
+				if (!tmp)
+					goto out;
+				out = tmp;
+			}
+			if (line_new(con, &out[rows], width))
+				goto out;
+
+			i = pos;
+			reflow_fill(con, out[rows], width, &pos, ends[e]);
+			if (e == cur_line && cur >= i &&
+			    (cur < pos || pos == ends[e])) {
+				cur_y = rows;
+				for (cur_x = 0; i < cur; ++i)
+					cur_x += con->reflow_buf[i].width;
+				if (cur_x > width)
+					cur_x = width;
+			}
+			++rows;
+		} while (pos < ends[e]);
+	}
+
+	/* rows that do not fit go to the scrollback buffer, the cursor stays */
+	push = rows > con->size_y ? rows - con->size_y : 0;
+	if (push > cur_y)
+		push = cur_y;
+
+	if (rows < push + con->size_y) {
+		tmp = realloc(out, sizeof(*out) * (push + con->size_y));
+		if (!tmp)
+			goto out;
+		out = tmp;
+		while (rows < push + con->size_y) {
+			if (line_new(con, &out[rows], width))
+				goto out;
+			++rows;
+		}
+	}
+
+	for (i = 0; i < push; ++i) {
+		out[i]->cols = width;
+		link_to_scrollback(con, out[i]);
+	}
+	for (y = 0; y < con->size_y; ++y) {
+		line_recycle(con, lines[y]);
+		lines[y] = out[push + y];
+	}
+	for (i = push + con->size_y; i < rows; ++i)
+		line_recycle(con, out[i]);
+	rows = 0;
+
+	con->cursor_x = cur_x;
+	con->cursor_y = cur_y - push;
+	if (con->sel_active)
+		tsm_screen_selection_reset(con);
+	screen_search_replaced(con, sb_id + SB_ID_STEP, UINT64_MAX);
+	ret = 0;
+
+out:
+	for (i = 0; i < rows; ++i)
+		line_recycle(con, out[i]);
+	free(out);
+	free(ends);
+	return ret;
+}
+
+/*
+ * Rewrap the logical scrollback line around @line for the current width,
+ * unless it is laid out for it already. Returns the line that now holds the
+ * first cell of @line.
+ */
+struct line *screen_sb_reflow(struct tsm_screen *con, struct line *line)
+{
+	struct line *first, *last, *next, *iter, *nl;
+	struct line *head = NULL, *tail = NULL, *ret = NULL, *pos_line = NULL;
+	const struct cell *cells;
+	unsigned int width = con->size_x, len = 0, pos = 0, num, i, x = 0;
+	unsigned int mark = 0, pos_mark = 0, pos_old = 0, pos_new = 0;
+	unsigned int k = 0, m = 0, hot = 0;
+	bool has_pos = false, has_sel = false;
+	uint64_t id, last_id;
+
+	if (line->cols == width)
+		return line;
+
+	first = line;
+	while (first->prev && first->prev->wrap)
+		first = first->prev;
+	last = line;
+	while (last->wrap && last->next)
+		last = last->next;
+
+	for (iter = first; ; iter = iter->next) {
+		cells = screen_line_cells(con, iter);
+		if (!cells)
+			return line;
+
+		if (iter->wrap)
+			num = iter->wrap < iter->size ? iter->wrap : iter->size;
+		else
+			num = cells_used(cells, iter->size);
+
+		/* a single line that fits only needs its width updated */
+		if (first == last && !iter->wrap && num <= width) {
+			line->cols = width;
+			return line;
+		}
+
+		if (iter == line)
+			mark = len;
+		if (iter == con->sb_pos) {
+			has_pos = true;
+			pos_mark = len;
+			pos_old = k;
+		}
+		if (con->sel_active && (iter == con->sel_start.line ||
+					iter == con->sel_end.line))
+			has_sel = true;
+		if (con->sb_hot && iter->sb_id >= con->sb_hot->sb_id)
+			++hot;
+
+		if (reflow_gather(con, cells, num, &len))
+			return line;
+		++k;
+		if (iter == last)
+			break;
+	}
+
+	do {
+		if (line_new(con, &nl, width))
+			goto err;
+		nl->prev = tail;
+		if (tail)
+			tail->next = nl;
+		else
+			head = nl;
+		tail = nl;
+
+		i = pos;
+		x = reflow_fill(con, nl, width, &pos, len);
+		if (!ret && mark >= i && (mark < pos || pos == len))
+			ret = nl;
+		if (!pos_line && has_pos && pos_mark >= i &&
+		    (pos_mark < pos || pos == len)) {
+			pos_line = nl;
+			pos_new = m;
+		}
+		++m;
+	} while (pos < len);
+
+	/* the line continues on the screen */
+	if (last->wrap)
+		tail->wrap = x;
+
+	id = first->sb_id;
+	last_id = last->sb_id;
+	next = last->next;
+	if (next && id + m > next->sb_id) {
+		/* no ids left in between, keep the old layout */
+		for (iter = first; iter != next; iter = iter->next)
+			iter->cols = width;
+		goto err;
+	}
+
+	head->prev = first->prev;
+	if (first->prev)
+		first->prev->next = head;
+	else
+		con->sb_first = head;
+	tail->next = next;
+	if (next)
+		next->prev = tail;
+	else
+		con->sb_last = tail;
+
+	for (iter = head, i = 0; i < m; iter = iter->next, ++i) {
+		iter->sb_id = id + i;
+		iter->cols = width;
+		if (!hot)
+			line_pack(con, iter);
+	}
+	if (con->sb_last_id < id + m - 1)
+		con->sb_last_id = id + m - 1;
+
+	con->sb_count += m - k;
+	if (has_pos) {
+		con->sb_pos = pos_line;
+		con->sb_pos_num += pos_new - pos_old;
+	} else if (!con->sb_pos || con->sb_pos->sb_id > id) {
+		con->sb_pos_num += m - k;
+	}
+	if (hot) {
+		if (con->sb_hot->sb_id >= id)
+			con->sb_hot = head;
+		con->sb_hot_num += m - hot;
+	}
+	if (has_sel)
+		tsm_screen_selection_reset(con);
+
+	for (iter = first; k--; iter = next) {
+		next = iter->next;
+		line_recycle(con, iter);
+	}
+
+	screen_search_replaced(con, id, last_id > id + m - 1 ?
+					last_id : id + m - 1);
+	screen_inc_age(con);
+	/* TODO: more sophisticated ageing */
+	con->age = con->age_cnt;
+
+	return ret;
+
+err:
+	while (head) {
+		iter = head;
+		head = head->next;
+		line_recycle(con, iter);
+	}
+	return line;
+}
+
+/* rewrap the scrollback lines in view for the current width */
+void screen_reflow_view(struct tsm_screen *con)
+{
+	struct line *iter;
+	unsigned int i;
+
+	/* trimming can move the view onto lines not rewrapped yet */
+	do {
+		iter = con->sb_pos;
+		for (i = 0; iter && i < con->size_y; ++i)
+			iter = screen_sb_reflow(con, iter)->next;
+	} while (screen_sb_trim(con));
 }
 
 static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
 {
-	unsigned int i, j, max, pos;
+	unsigned int i, max, pos;
 	int ret;
 
 	if (!num)
@@ -303,11 +1222,12 @@ static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
 			ret = -EAGAIN;
 
 		if (!ret) {
+			con->lines[pos]->cols = con->size_x;
 			link_to_scrollback(con, con->lines[pos]);
 		} else {
 			cache[i] = con->lines[pos];
-			for (j = 0; j < con->size_x; ++j)
-				screen_cell_init(con, &cache[i]->cells[j]);
+			screen_cells_init(con, cache[i]->cells, con->size_x);
+			cache[i]->wrap = 0;
 		}
 	}
 
@@ -344,7 +1264,7 @@ static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
 
 static void screen_scroll_down(struct tsm_screen *con, unsigned int num)
 {
-	unsigned int i, j, max;
+	unsigned int i, max;
 
 	if (!num)
 		return;
@@ -365,8 +1285,8 @@ static void screen_scroll_down(struct tsm_screen *con, unsigned int num)
 
 	for (i = 0; i < num; ++i) {
 		cache[i] = con->lines[con->margin_bottom - i];
-		for (j = 0; j < con->size_x; ++j)
-			screen_cell_init(con, &cache[i]->cells[j]);
+		screen_cells_init(con, cache[i]->cells, con->size_x);
+		cache[i]->wrap = 0;
 	}
 
 	if (num < max) {
@@ -402,23 +1322,19 @@ static void screen_write(struct tsm_screen *con, unsigned int x,
 	}
 
 	line = con->lines[y];
+	line->age = con->age_cnt;
 
 	if ((con->flags & TSM_SCREEN_INSERT_MODE) &&
-	    (int)x < ((int)con->size_x - len)) {
-		line->age = con->age_cnt;
+	    (int)x < ((int)con->size_x - len))
 		memmove(&line->cells[x + len], &line->cells[x],
 			sizeof(struct cell) * (con->size_x - len - x));
-	}
 
-	line->cells[x].age = con->age_cnt;
 	line->cells[x].ch = ch;
 	line->cells[x].width = len;
-	memcpy(&line->cells[x].attr, attr, sizeof(*attr));
+	line->cells[x].style = screen_style_intern(con, attr);
 
-	for (i = 1; i < len && i + x < con->size_x; ++i) {
-		line->cells[x + i].age = con->age_cnt;
+	for (i = 1; i < len && i + x < con->size_x; ++i)
 		line->cells[x + i].width = 0;
-	}
 }
 
 static void screen_erase_region(struct tsm_screen *con,
@@ -428,12 +1344,14 @@ static void screen_erase_region(struct tsm_screen *con,
 				 unsigned int y_to,
 				 bool protect)
 {
-	unsigned int to;
+	unsigned int to, style;
 	struct line *line;
 
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
 
+	style = screen_style_intern(con, &con->def_attr);
+
 	if (y_to >= con->size_y)
 		y_to = con->size_y - 1;
 	if (x_to >= con->size_x)
@@ -450,11 +1368,14 @@ static void screen_erase_region(struct tsm_screen *con,
 			to = x_to;
 		else
 			to = con->size_x - 1;
+		if (!x_from && to == con->size_x - 1 && !protect)
+			line->wrap = 0;
 		for ( ; x_from <= to; ++x_from) {
-			if (protect && line->cells[x_from].attr.protect)
+			if (protect &&
+			    screen_cell_attr(con, &line->cells[x_from])->protect)
 				continue;
 
-			screen_cell_init(con, &line->cells[x_from]);
+			screen_cell_init_style(&line->cells[x_from], style);
 		}
 		x_from = 0;
 	}
@@ -496,6 +1417,7 @@ int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data)
 	con->def_attr.fr = 255;
 	con->def_attr.fg = 255;
 	con->def_attr.fb = 255;
+	con->style_limit = STYLE_MIN_LIMIT;
 
 	ret = tsm_symbol_table_new(&con->sym_table);
 	if (ret)
@@ -515,9 +1437,16 @@ err_free:
 		line_free(con->main_lines[i]);
 		line_free(con->alt_lines[i]);
 	}
+	line_pool_clear(con);
+	free(con->unpacked);
+	free(con->pack_buf);
+	free(con->reflow_buf);
+	free(con->run_buf);
 	free(con->main_lines);
 	free(con->alt_lines);
 	free(con->tab_ruler);
+	free(con->styles);
+	free(con->style_index);
 	tsm_symbol_table_unref(con->sym_table);
 	free(con);
 	return ret;
@@ -551,7 +1480,15 @@ void tsm_screen_unref(struct tsm_screen *con)
 	free(con->alt_lines);
 	free(con->tab_ruler);
 	tsm_symbol_table_unref(con->sym_table);
+	tsm_screen_search_reset(con);
 	tsm_screen_clear_sb(con);
+	line_pool_clear(con);
+	free(con->unpacked);
+	free(con->pack_buf);
+	free(con->reflow_buf);
+	free(con->run_buf);
+	free(con->styles);
+	free(con->style_index);
 	free(con);
 }
 
@@ -602,9 +1539,9 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 		      unsigned int y)
 {
 	struct line **cache;
-	unsigned int i, j, width, diff, start;
+	unsigned int i, j, width, diff, start, style, style_main;
 	int ret;
-	bool *tab_ruler;
+	bool *tab_ruler, reflowed = false;
 
 	if (!con || !x || !y)
 		return -EINVAL;
@@ -682,27 +1619,42 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 
 	screen_inc_age(con);
 
+	/* rewrap the main screen; if that is not possible the lines are
+	 * truncated or padded below */
+	if (con->size_x && x != con->size_x &&
+	    !(con->flags & TSM_SCREEN_ALTERNATE))
+		reflowed = !screen_reflow(con, x);
+
 	/* clear expansion/padding area */
 	start = x;
 	if (x > con->size_x)
 		start = con->size_x;
+	style_main = screen_style_intern(con, &con->def_attr_main);
+	style = screen_style_intern(con, &con->def_attr);
 	for (j = 0; j < con->line_num; ++j) {
 		/* main-lines may go into SB, so clear all cells */
 		i = 0;
 		if (j < con->size_y)
-			i = start;
+			i = reflowed ? con->main_lines[j]->size : start;
+		if (con->main_lines[j]->wrap > x)
+			con->main_lines[j]->wrap = x;
 
+		if (i < con->main_lines[j]->size)
+			con->main_lines[j]->age = con->age_cnt;
 		for ( ; i < con->main_lines[j]->size; ++i)
-			screen_cell_init_generic(con, &con->main_lines[j]->cells[i],
-				&con->def_attr_main);
+			screen_cell_init_style(&con->main_lines[j]->cells[i],
+					       style_main);
 
 		/* alt-lines never go into SB, only clear visible cells */
 		i = 0;
 		if (j < con->size_y)
 			i = con->size_x;
 
+		if (i < x)
+			con->alt_lines[j]->age = con->age_cnt;
 		for ( ; i < x; ++i)
-			screen_cell_init(con, &con->alt_lines[j]->cells[i]);
+			screen_cell_init_style(&con->alt_lines[j]->cells[i],
+					       style);
 	}
 
 	/* xterm destroys margins on resize, so do we */
@@ -796,6 +1748,11 @@ void tsm_screen_set_max_sb(struct tsm_screen *con,
 			con->sb_last = NULL;
 		con->sb_count--;
 
+		if (con->sb_hot == line) {
+			con->sb_hot = line->next;
+			--con->sb_hot_num;
+		}
+
 		/* We treat fixed/unfixed position the same here because we
 		 * remove lines from the TOP of the scrollback buffer. */
 		if (con->sb_pos == line)
@@ -811,7 +1768,7 @@ void tsm_screen_set_max_sb(struct tsm_screen *con,
 				con->sel_end.y = SELECTION_TOP;
 			}
 		}
-		line_free(line);
+		line_recycle(con, line);
 	}
 
 	con->sb_max = max;
@@ -833,7 +1790,7 @@ void tsm_screen_clear_sb(struct tsm_screen *con)
 	for (iter = con->sb_first; iter; ) {
 		tmp = iter;
 		iter = iter->next;
-		line_free(tmp);
+		line_recycle(con, tmp);
 	}
 
 	con->sb_first = NULL;
@@ -841,6 +1798,8 @@ void tsm_screen_clear_sb(struct tsm_screen *con)
 	con->sb_count = 0;
 	con->sb_pos = NULL;
 	con->sb_pos_num = 0;
+	con->sb_hot = NULL;
+	con->sb_hot_num = 0;
 
 	if (con->sel_active) {
 		if (con->sel_start.line) {
@@ -869,14 +1828,17 @@ void tsm_screen_sb_up(struct tsm_screen *con, unsigned int num)
 			if (!con->sb_pos->prev)
 				return;
 
+			screen_sb_reflow(con, con->sb_pos->prev);
 			con->sb_pos = con->sb_pos->prev;
 			--con->sb_pos_num;
 		} else if (!con->sb_last) {
 			return;
 		} else {
+			screen_sb_reflow(con, con->sb_last);
 			con->sb_pos = con->sb_last;
 			con->sb_pos_num = con->sb_count - 1;
 		}
+		screen_sb_trim(con);
 	}
 }
 
@@ -990,7 +1952,6 @@ SHL_EXPORT
 void tsm_screen_set_flags(struct tsm_screen *con, unsigned int flags)
 {
 	unsigned int old;
-	struct cell *c;
 
 	if (!con || !flags)
 		return;
@@ -1010,8 +1971,7 @@ void tsm_screen_set_flags(struct tsm_screen *con, unsigned int flags)
 
 	if (!(old & TSM_SCREEN_HIDE_CURSOR) &&
 	    (flags & TSM_SCREEN_HIDE_CURSOR)) {
-		c = get_cursor_cell(con);
-		c->age = con->age_cnt;
+		get_cursor_line(con)->age = con->age_cnt;
 	}
 
 	if (!(old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE))
@@ -1022,7 +1982,6 @@ SHL_EXPORT
 void tsm_screen_reset_flags(struct tsm_screen *con, unsigned int flags)
 {
 	unsigned int old;
-	struct cell *c;
 
 	if (!con || !flags)
 		return;
@@ -1039,8 +1998,7 @@ void tsm_screen_reset_flags(struct tsm_screen *con, unsigned int flags)
 
 	if ((old & TSM_SCREEN_HIDE_CURSOR) &&
 	    (flags & TSM_SCREEN_HIDE_CURSOR)) {
-		c = get_cursor_cell(con);
-		c->age = con->age_cnt;
+		get_cursor_line(con)->age = con->age_cnt;
 	}
 
 	if ((old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE))
@@ -1104,6 +2062,36 @@ void tsm_screen_reset_all_tabstops(struct tsm_screen *con)
 		con->tab_ruler[i] = false;
 }
 
+/*
+ * Append a zero-width character to the symbol left of the cursor, skipping
+ * back over the continuation cells of wide characters. With a pending wrap the
+ * cursor sits past the last column, which is then the one combined with.
+ */
+static void screen_combine(struct tsm_screen *con, tsm_symbol_t ch)
+{
+	struct line *line;
+	struct cell *cell;
+	unsigned int x;
+
+	if (!con->cursor_x || con->cursor_y >= con->size_y)
+		return;
+
+	x = con->cursor_x;
+	if (x > con->size_x)
+		x = con->size_x;
+	line = con->lines[con->cursor_y];
+	do {
+		cell = &line->cells[--x];
+	} while (x && !cell->width);
+
+	if (!cell->ch)
+		return;
+
+	screen_inc_age(con);
+	line->age = con->age_cnt;
+	cell->ch = tsm_symbol_append(con->sym_table, cell->ch, ch);
+}
+
 SHL_EXPORT
 void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 			  const struct tsm_screen_attr *attr)
@@ -1114,9 +2102,15 @@ void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 		return;
 
 	len = tsm_symbol_get_width(con->sym_table, ch);
-	if (!len)
+	if (!len) {
+		/* controls (all below 0xa0) are dropped, combining marks and
+		 * other zero-width characters join the preceding cell */
+		if (ch >= 0xa0)
+			screen_combine(con, ch);
 		return;
+	}
 
+	screen_style_maybe_collect(con);
 	screen_inc_age(con);
 
 	if (con->cursor_y <= con->margin_bottom ||
@@ -1126,9 +2120,10 @@ void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 		last = con->size_y - 1;
 
 	if (con->cursor_x >= con->size_x) {
-		if (con->flags & TSM_SCREEN_AUTO_WRAP)
+		if (con->flags & TSM_SCREEN_AUTO_WRAP) {
+			con->lines[con->cursor_y]->wrap = con->size_x;
 			move_cursor(con, 0, con->cursor_y + 1);
-		else
+		} else
 			move_cursor(con, con->size_x - 1, con->cursor_y);
 	}
 
@@ -1141,6 +2136,78 @@ void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 	move_cursor(con, con->cursor_x + len, con->cursor_y);
 }
 
+/*
+ * Write a run of single-width symbols starting at the cursor. This behaves
+ * exactly like calling tsm_screen_write() for each symbol, but fills whole
+ * line segments at once and only ages the screen once per run. Callers must
+ * make sure every symbol has a width of 1 (like printable ASCII).
+ */
+SHL_EXPORT
+void tsm_screen_write_run(struct tsm_screen *con, const tsm_symbol_t *ch,
+			  size_t num, const struct tsm_screen_attr *attr)
+{
+	unsigned int last, x, n, i, style;
+	struct line *line;
+	struct cell *cell;
+
+	if (!con || !ch || !num)
+		return;
+
+	screen_style_maybe_collect(con);
+	screen_inc_age(con);
+	style = screen_style_intern(con, attr);
+
+	while (num) {
+		if (con->cursor_y <= con->margin_bottom ||
+		    con->cursor_y >= con->size_y)
+			last = con->margin_bottom;
+		else
+			last = con->size_y - 1;
+
+		if (con->cursor_x >= con->size_x) {
+			if (con->flags & TSM_SCREEN_AUTO_WRAP) {
+				con->lines[con->cursor_y]->wrap = con->size_x;
+				move_cursor(con, 0, con->cursor_y + 1);
+			} else {
+				/* every symbol overwrites the last column, so
+				 * only the final one is visible */
+				move_cursor(con, con->size_x - 1, con->cursor_y);
+				ch += num - 1;
+				num = 1;
+			}
+		}
+
+		if (con->cursor_y > last) {
+			move_cursor(con, con->cursor_x, last);
+			screen_scroll_up(con, 1);
+		}
+
+		x = con->cursor_x;
+		n = con->size_x - x;
+		if (n > num)
+			n = num;
+
+		line = con->lines[con->cursor_y];
+		line->age = con->age_cnt;
+
+		if ((con->flags & TSM_SCREEN_INSERT_MODE) &&
+		    x + n < con->size_x)
+			memmove(&line->cells[x + n], &line->cells[x],
+				sizeof(struct cell) * (con->size_x - n - x));
+
+		for (i = 0; i < n; ++i) {
+			cell = &line->cells[x + i];
+			cell->ch = ch[i];
+			cell->width = 1;
+			cell->style = style;
+		}
+
+		move_cursor(con, x + n, con->cursor_y);
+		ch += n;
+		num -= n;
+	}
+}
+
 SHL_EXPORT
 void tsm_screen_newline(struct tsm_screen *con)
 {
@@ -1378,7 +2445,7 @@ void tsm_screen_tab_left(struct tsm_screen *con, unsigned int num)
 SHL_EXPORT
 void tsm_screen_insert_lines(struct tsm_screen *con, unsigned int num)
 {
-	unsigned int i, j, max;
+	unsigned int i, max;
 
 	if (!con || !num)
 		return;
@@ -1399,8 +2466,8 @@ void tsm_screen_insert_lines(struct tsm_screen *con, unsigned int num)
 
 	for (i = 0; i < num; ++i) {
 		cache[i] = con->lines[con->margin_bottom - i];
-		for (j = 0; j < con->size_x; ++j)
-			screen_cell_init(con, &cache[i]->cells[j]);
+		screen_cells_init(con, cache[i]->cells, con->size_x);
+		cache[i]->wrap = 0;
 	}
 
 	if (num < max) {
@@ -1418,7 +2485,7 @@ void tsm_screen_insert_lines(struct tsm_screen *con, unsigned int num)
 SHL_EXPORT
 void tsm_screen_delete_lines(struct tsm_screen *con, unsigned int num)
 {
-	unsigned int i, j, max;
+	unsigned int i, max;
 
 	if (!con || !num)
 		return;
@@ -1439,8 +2506,8 @@ void tsm_screen_delete_lines(struct tsm_screen *con, unsigned int num)
 
 	for (i = 0; i < num; ++i) {
 		cache[i] = con->lines[con->cursor_y + i];
-		for (j = 0; j < con->size_x; ++j)
-			screen_cell_init(con, &cache[i]->cells[j]);
+		screen_cells_init(con, cache[i]->cells, con->size_x);
+		cache[i]->wrap = 0;
 	}
 
 	if (num < max) {
@@ -1459,7 +2526,7 @@ SHL_EXPORT
 void tsm_screen_insert_chars(struct tsm_screen *con, unsigned int num)
 {
 	struct cell *cells;
-	unsigned int max, mv, i;
+	unsigned int max, mv;
 
 	if (!con || !num || !con->size_y || !con->size_x)
 		return;
@@ -1484,15 +2551,14 @@ void tsm_screen_insert_chars(struct tsm_screen *con, unsigned int num)
 			&cells[con->cursor_x],
 			mv * sizeof(*cells));
 
-	for (i = 0; i < num; ++i)
-		screen_cell_init(con, &cells[con->cursor_x + i]);
+	screen_cells_init(con, &cells[con->cursor_x], num);
 }
 
 SHL_EXPORT
 void tsm_screen_delete_chars(struct tsm_screen *con, unsigned int num)
 {
 	struct cell *cells;
-	unsigned int max, mv, i;
+	unsigned int max, mv;
 
 	if (!con || !num || !con->size_y || !con->size_x)
 		return;
@@ -1517,8 +2583,7 @@ void tsm_screen_delete_chars(struct tsm_screen *con, unsigned int num)
 			&cells[con->cursor_x + num],
 			mv * sizeof(*cells));
 
-	for (i = 0; i < num; ++i)
-		screen_cell_init(con, &cells[con->cursor_x + mv + i]);
+	screen_cells_init(con, &cells[con->cursor_x + mv], num);
 }
 
 SHL_EXPORT
@@ -0,0 +1,655 @@
+/*
+ * libtsm - Scrollback Search
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Scrollback Search
+ * Case-insensitive substring search over the scrollback buffer and the active
+ * screen. Matches never span lines.
+ *
+ * Rows are numbered so a line keeps its number when it scrolls into the
+ * scrollback buffer: scrollback lines use their sb_id and active line y is
+ * sb_last_id + (1 + y) * SB_ID_STEP, which is the sb_id it gets once linked.
+ * Row numbers are ordered but not contiguous, scans step along the lines.
+ *
+ * Lines are searched in a folded text form with one byte per cell:
+ * lower-cased ASCII, a 7-bit hash with the high bit set for anything else,
+ * ' ' for empty cells and 0 for the second half of wide characters. The
+ * needle is folded the same way, so a byte offset is a cell index. Matches
+ * of needles with non-ASCII characters are verified against the cells.
+ * Scrollback lines only change by being replaced on reflow, so their text is
+ * cached in the line until the search is reset; active lines are folded into
+ * a scratch buffer.
+ *
+ * tsm_screen_search() sets the needle, tsm_screen_search_next() starts a scan
+ * for the next match above or below the current one and
+ * tsm_screen_search_run() advances a pending scan by a bounded number of lines
+ * so a terminal can spread a scan over huge scrollback buffers across frames.
+ * Every visible match is reported to the draw callback through attr->match,
+ * the current one additionally through attr->match_focus.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "libtsm.h"
+#include "libtsm-int.h"
+#include "shl-llog.h"
+
+#define LLOG_SUBSYSTEM "tsm-search"
+
+static uint8_t search_fold(uint32_t ch)
+{
+	if (!ch)
+		return ' ';
+	if (ch < 0x80)
+		return (ch >= 'A' && ch <= 'Z') ? ch + 'a' - 'A' : ch;
+
+	return 0x80 | ((ch ^ (ch >> 7) ^ (ch >> 14)) & 0x7f);
+}
+
+static uint32_t cell_base(struct tsm_screen *con, const struct cell *cell)
+{
+	return *tsm_symbol_get(con->sym_table, &cell->ch, NULL);
+}
+
+/* fold @num cells into @text, returns the length without trailing blanks */
+static unsigned int search_fold_cells(struct tsm_screen *con,
+				      const struct cell *cells,
+				      unsigned int num, uint8_t *text)
+{
+	unsigned int i, len = 0;
+
+	for (i = 0; i < num; ++i) {
+		if (!cells[i].width)
+			text[i] = 0;
+		else if (cells[i].ch < 0x80)
+			text[i] = search_fold(cells[i].ch);
+		else
+			text[i] = search_fold(cell_base(con, &cells[i]));
+		if (text[i] != ' ')
+			len = i + 1;
+	}
+
+	return len;
+}
+
+/*
+ * Return the folded text of @line. Scrollback lines are folded once and keep
+ * their text, active lines are folded into a scratch buffer that is only
+ * valid until the next call.
+ */
+static const uint8_t *search_text(struct tsm_screen *con, struct line *line,
+				  unsigned int *len)
+{
+	const struct cell *cells;
+	uint8_t *text;
+
+	if (line->text) {
+		*len = line->text_len;
+		return line->text;
+	}
+
+	cells = screen_line_cells(con, line);
+	if (!cells || !line->size)
+		return NULL;
+
+	if (line->sb_id) {
+		text = malloc(line->size);
+		if (!text)
+			return NULL;
+		line->text = text;
+		line->text_len = search_fold_cells(con, cells, line->size,
+						   text);
+		/* trailing blanks never match, do not keep them around */
+		if (line->text_len < line->size) {
+			text = realloc(text, line->text_len ? : 1);
+			if (text)
+				line->text = text;
+		}
+		*len = line->text_len;
+		return line->text;
+	}
+
+	if (con->search_buf_size < line->size) {
+		text = realloc(con->search_buf, line->size);
+		if (!text)
+			return NULL;
+		con->search_buf = text;
+		con->search_buf_size = line->size;
+	}
+
+	*len = search_fold_cells(con, cells, line->size, con->search_buf);
+	return con->search_buf;
+}
+
+/*
+ * Find the first occurrence of @needle (@n >= 2 bytes) in @hay. The SSE2 path
+ * compares the first and last needle byte against 16 positions at once and
+ * only runs memcmp() where both match.
+ */
+static const uint8_t *search_find(const uint8_t *hay, size_t len,
+				  const uint8_t *needle, size_t n)
+{
+	size_t i = 0;
+
+	if (n > len)
+		return NULL;
+	if (n == 1)
+		return memchr(hay, needle[0], len);
+
+#if defined(__SSE2__)
+	const __m128i first = _mm_set1_epi8((char)needle[0]);
+	const __m128i last = _mm_set1_epi8((char)needle[n - 1]);
+	unsigned int mask, bit;
+
+	for ( ; i + n - 1 + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&hay[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&hay[i + n - 1]);
+
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+						       _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			bit = __builtin_ctz(mask);
+			if (!memcmp(&hay[i + bit + 1], &needle[1], n - 2))
+				return &hay[i + bit];
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for ( ; i + n <= len; ++i) {
+		if (hay[i] == needle[0] && hay[i + n - 1] == needle[n - 1] &&
+		    !memcmp(&hay[i + 1], &needle[1], n - 2))
+			return &hay[i];
+	}
+
+	return NULL;
+}
+
+/* compare the real characters of a folded match of a non-ASCII needle */
+static bool search_verify(struct tsm_screen *con, struct line *line,
+			  unsigned int x)
+{
+	const struct cell *cells;
+	unsigned int i;
+	uint32_t ch, want;
+
+	cells = screen_line_cells(con, line);
+	if (!cells)
+		return false;
+
+	for (i = 0; i < con->search_ucs4_len; ++i) {
+		if (x >= line->size)
+			return false;
+		ch = cell_base(con, &cells[x]);
+		want = con->search_ucs4[i];
+		if (ch != want && (want >= 0x80 ||
+				   search_fold(ch) != search_fold(want)))
+			return false;
+		x += cells[x].width ? cells[x].width : 1;
+	}
+
+	return true;
+}
+
+/*
+ * Find a match in @line. With @up the last match starting before @limit is
+ * returned, otherwise the first one starting at or after @limit. Returns the
+ * cell index or -1.
+ */
+static int search_line(struct tsm_screen *con, struct line *line,
+		       unsigned int limit, bool up)
+{
+	const uint8_t *text, *p;
+	unsigned int len, x;
+	int found = -1;
+
+	text = search_text(con, line, &len);
+	if (!text)
+		return -1;
+
+	x = up ? 0 : limit;
+	while (x < len) {
+		p = search_find(&text[x], len - x, con->search_needle,
+				con->search_len);
+		if (!p)
+			break;
+		x = p - text;
+		if (up && x >= limit)
+			break;
+		if (!con->search_exact || search_verify(con, line, x)) {
+			found = x;
+			if (!up)
+				break;
+		}
+		++x;
+	}
+
+	return found;
+}
+
+/* row shown at the top or the bottom of the view */
+static uint64_t search_view_row(struct tsm_screen *con, bool bottom)
+{
+	struct line *iter = con->sb_pos;
+	unsigned int n = bottom ? con->size_y - 1 : 0;
+
+	for ( ; iter && n; --n)
+		iter = iter->next;
+	if (iter)
+		return iter->sb_id;
+
+	return con->sb_last_id + (n + 1) * SB_ID_STEP;
+}
+
+/* map a row number to its line, NULL if the row does not exist (anymore) */
+static struct line *search_row_line(struct tsm_screen *con, uint64_t row)
+{
+	struct line *line;
+	uint64_t dist, d;
+
+	if (row > con->sb_last_id) {
+		d = row - con->sb_last_id;
+		if (d % SB_ID_STEP || d / SB_ID_STEP > con->size_y)
+			return NULL;
+		return con->lines[d / SB_ID_STEP - 1];
+	}
+
+	if (!con->sb_first || row < con->sb_first->sb_id)
+		return NULL;
+
+	/* walk from the closest of the first, the last and the previously
+	 * looked up sb line; scans only move one row at a time */
+	line = con->sb_first;
+	dist = row - con->sb_first->sb_id;
+	d = con->sb_last->sb_id > row ? con->sb_last->sb_id - row : 0;
+	if (d < dist) {
+		line = con->sb_last;
+		dist = d;
+	}
+	if (con->search_line) {
+		d = con->search_line->sb_id > row ?
+		    con->search_line->sb_id - row :
+		    row - con->search_line->sb_id;
+		if (d < dist)
+			line = con->search_line;
+	}
+
+	/* rows of lines replaced by a reflow map to the line above */
+	while (line->next && line->sb_id < row)
+		line = line->next;
+	while (line->prev && line->sb_id > row)
+		line = line->prev;
+
+	con->search_line = line;
+	return line;
+}
+
+/* move the scan from @line to the row above or below, false at the end */
+static bool search_step(struct tsm_screen *con, struct line *line)
+{
+	uint64_t last = con->sb_last_id + con->size_y * SB_ID_STEP;
+
+	if (line->sb_id && con->search_up) {
+		if (!line->prev)
+			return false;
+		con->search_row = line->prev->sb_id;
+	} else if (line->sb_id) {
+		con->search_row = line->next ? line->next->sb_id :
+				  con->sb_last_id + SB_ID_STEP;
+	} else if (con->search_up) {
+		if (con->search_row - con->sb_last_id > SB_ID_STEP)
+			con->search_row -= SB_ID_STEP;
+		else if (con->sb_last)
+			con->search_row = con->sb_last->sb_id;
+		else
+			return false;
+	} else {
+		if (con->search_row >= last)
+			return false;
+		con->search_row += SB_ID_STEP;
+	}
+
+	con->search_x = con->search_up ? UINT_MAX : 0;
+	return true;
+}
+
+/* scroll the scrollback buffer so the current match is visible */
+static void search_show(struct tsm_screen *con)
+{
+	struct line *line, *iter;
+	unsigned int n, num;
+	uint64_t row = con->match_row;
+
+	for (iter = con->sb_pos, n = 0; iter && n < con->size_y; ++n) {
+		if (iter->sb_id == row)
+			return;
+		iter = iter->next;
+	}
+
+	if (row > con->sb_last_id) {
+		if (n + (row - con->sb_last_id) / SB_ID_STEP > con->size_y) {
+			con->sb_pos = NULL;
+			con->sb_pos_num = con->sb_count;
+		}
+		return;
+	}
+
+	line = search_row_line(con, row);
+	if (!line)
+		return;
+
+	/* show a little context above the match */
+	for (n = con->size_y / 3; n && line->prev; --n)
+		line = line->prev;
+
+	if (con->sb_pos) {
+		iter = con->sb_pos;
+		num = con->sb_pos_num;
+	} else {
+		iter = con->sb_last;
+		num = con->sb_count - 1;
+	}
+	while (iter->sb_id > line->sb_id) {
+		iter = iter->prev;
+		--num;
+	}
+	while (iter->sb_id < line->sb_id) {
+		iter = iter->next;
+		++num;
+	}
+
+	con->sb_pos = line;
+	con->sb_pos_num = num;
+}
+
+static void search_redraw(struct tsm_screen *con)
+{
+	screen_inc_age(con);
+	/* TODO: more sophisticated ageing */
+	con->age = con->age_cnt;
+}
+
+/* drop the cached text of all scrollback lines */
+static void search_free_text(struct tsm_screen *con)
+{
+	struct line *iter;
+
+	for (iter = con->sb_first; iter; iter = iter->next) {
+		free(iter->text);
+		iter->text = NULL;
+	}
+}
+
+SHL_EXPORT
+void tsm_screen_search_reset(struct tsm_screen *con)
+{
+	if (!con)
+		return;
+
+	search_free_text(con);
+	free(con->search_needle);
+	free(con->search_ucs4);
+	free(con->search_buf);
+	free(con->search_hits);
+	con->search_needle = NULL;
+	con->search_ucs4 = NULL;
+	con->search_buf = NULL;
+	con->search_hits = NULL;
+	con->search_len = 0;
+	con->search_ucs4_len = 0;
+	con->search_buf_size = 0;
+	con->search_hits_size = 0;
+	con->search_scan = false;
+	con->search_found = false;
+	con->search_line = NULL;
+	search_redraw(con);
+}
+
+/*
+ * Set the search string to the @len bytes of UTF-8 at @needle. The current
+ * match is kept if it still matches, otherwise a scan upwards from it (or
+ * from the bottom of the view) is started. An empty needle clears all
+ * matches but keeps the search state.
+ */
+SHL_EXPORT
+int tsm_screen_search(struct tsm_screen *con, const char *needle, size_t len)
+{
+	struct tsm_utf8_mach *mach;
+	uint8_t *folded;
+	uint32_t *ucs4, ch;
+	unsigned int n = 0, num = 0, w;
+	bool exact = false;
+	size_t i;
+	int ret, state;
+
+	if (!con || (!needle && len))
+		return -EINVAL;
+
+	/* every character folds to at most two cells */
+	folded = malloc(len * 2 + 1);
+	ucs4 = malloc(sizeof(*ucs4) * (len + 1));
+	ret = tsm_utf8_mach_new(&mach);
+	if (!folded || !ucs4 || ret) {
+		free(folded);
+		free(ucs4);
+		tsm_utf8_mach_free(mach);
+		return ret ? ret : -ENOMEM;
+	}
+
+	for (i = 0; i < len; ++i) {
+		state = tsm_utf8_mach_feed(mach, needle[i]);
+		if (state != TSM_UTF8_ACCEPT && state != TSM_UTF8_REJECT)
+			continue;
+
+		ch = tsm_utf8_mach_get(mach);
+		w = tsm_ucs4_get_width(ch);
+		if (!w)
+			continue;
+
+		ucs4[num++] = ch;
+		folded[n++] = search_fold(ch);
+		if (w > 1)
+			folded[n++] = 0;
+		if (ch >= 0x80)
+			exact = true;
+	}
+	tsm_utf8_mach_free(mach);
+
+	free(con->search_needle);
+	free(con->search_ucs4);
+	con->search_needle = folded;
+	con->search_ucs4 = ucs4;
+	con->search_len = n;
+	con->search_ucs4_len = num;
+	con->search_exact = exact;
+	search_redraw(con);
+
+	if (!n) {
+		con->search_scan = false;
+		con->search_found = false;
+		return 0;
+	}
+
+	if (con->search_found) {
+		con->search_row = con->match_row;
+		con->search_x = con->match_x + 1;
+	} else {
+		con->search_row = search_view_row(con, true);
+		con->search_x = UINT_MAX;
+	}
+	con->search_up = true;
+	con->search_scan = true;
+	con->search_found = false;
+
+	return 0;
+}
+
+/*
+ * Start a scan for the next match above (@up) or below the current one, or
+ * from the edge of the view if there is none.
+ */
+SHL_EXPORT
+int tsm_screen_search_next(struct tsm_screen *con, bool up)
+{
+	if (!con)
+		return -EINVAL;
+	if (!con->search_len)
+		return -ENOENT;
+
+	if (con->search_found) {
+		con->search_row = con->match_row;
+		con->search_x = up ? con->match_x : con->match_x + 1;
+	} else if (up) {
+		con->search_row = search_view_row(con, true);
+		con->search_x = UINT_MAX;
+	} else {
+		con->search_row = search_view_row(con, false);
+		con->search_x = 0;
+	}
+	con->search_up = up;
+	con->search_scan = true;
+
+	return 0;
+}
+
+/*
+ * Advance a pending scan by at most @budget lines. Returns 1 if a match was
+ * found and scrolled into view, 0 if the scan is still pending and -ENOENT if
+ * it ended without a match (the previous match, if any, stays current).
+ */
+SHL_EXPORT
+int tsm_screen_search_run(struct tsm_screen *con, unsigned int budget)
+{
+	struct line *line;
+	int x;
+
+	if (!con)
+		return -EINVAL;
+	if (!con->search_scan)
+		return -ENOENT;
+
+	for ( ; budget; --budget) {
+		line = search_row_line(con, con->search_row);
+		if (!line)
+			break;
+
+		x = search_line(con, line, con->search_x, con->search_up);
+		if (x >= 0) {
+			con->search_scan = false;
+			con->search_found = true;
+			con->match_row = con->search_row;
+			con->match_x = x;
+			search_show(con);
+			search_redraw(con);
+			return 1;
+		}
+
+		if (!search_step(con, line))
+			break;
+	}
+
+	if (budget)
+		con->search_scan = false;
+
+	return budget ? -ENOENT : 0;
+}
+
+SHL_EXPORT
+bool tsm_screen_search_pending(struct tsm_screen *con)
+{
+	return con && con->search_scan;
+}
+
+/*
+ * Mark the matches in @line, which is shown as row @row, for rendering.
+ * Returns one byte per cell (0, 1 for matches, 2 for the current match) or
+ * NULL if the line has no matches.
+ */
+const uint8_t *screen_search_mark(struct tsm_screen *con, struct line *line,
+				  uint64_t row)
+{
+	const uint8_t *text, *p;
+	unsigned int len, x, i;
+	uint8_t *hits;
+	bool any = false;
+
+	if (!con->search_len)
+		return NULL;
+
+	text = search_text(con, line, &len);
+	if (!text)
+		return NULL;
+
+	if (con->search_hits_size < line->size) {
+		hits = realloc(con->search_hits, line->size);
+		if (!hits)
+			return NULL;
+		con->search_hits = hits;
+		con->search_hits_size = line->size;
+	}
+	hits = con->search_hits;
+
+	for (x = 0; x < len; ++x) {
+		p = search_find(&text[x], len - x, con->search_needle,
+				con->search_len);
+		if (!p)
+			break;
+		x = p - text;
+		if (con->search_exact && !search_verify(con, line, x))
+			continue;
+
+		if (!any) {
+			memset(hits, 0, line->size);
+			any = true;
+		}
+		for (i = 0; i < con->search_len; ++i)
+			hits[x + i] = 1;
+		if (con->search_found && row == con->match_row &&
+		    x == con->match_x)
+			memset(&hits[x], 2, con->search_len);
+		x += con->search_len - 1;
+	}
+
+	return any ? hits : NULL;
+}
+
+/* rows @first to @last were replaced, forget matches and positions in them */
+void screen_search_replaced(struct tsm_screen *con, uint64_t first,
+			    uint64_t last)
+{
+	if (con->search_found && con->match_row >= first &&
+	    con->match_row <= last)
+		con->search_found = false;
+	if (con->search_scan && con->search_row >= first &&
+	    con->search_row <= last) {
+		con->search_row = first;
+		con->search_x = con->search_up ? UINT_MAX : 0;
+	}
+}
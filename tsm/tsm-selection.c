@@ -87,6 +87,7 @@ static void word_select(struct tsm_screen *con,
 {
 	int start, end;
 	struct line *line;
+	const struct cell *cells;
 
 	selection_set(con, &con->sel_start, posx, posy);
 
@@ -95,11 +96,15 @@ static void word_select(struct tsm_screen *con,
 	else
 	 	line = con->lines[con->sel_start.y];
 
-	if (!line || line->cells[posx].ch == ' ')
+	if (!line)
+		return;
+
+	cells = screen_line_cells(con, line);
+	if (!cells || cells[posx].ch == ' ')
 		return;
 
 	for (start = posx; start >= 0; start--) {
-		if (line->cells[start].ch == ' ') {
+		if (cells[start].ch == ' ') {
 			start++;
 			break;
 		}
@@ -108,8 +113,8 @@ static void word_select(struct tsm_screen *con,
 		start = 0;
 
 	for (end = posx; end < line->size; end++) {
-		if (line->cells[end].ch == ' ' || line->cells[end].ch == '\n' ||
-		    line->cells[end].ch == '\0') {
+		if (cells[end].ch == ' ' || cells[end].ch == '\n' ||
+		    cells[end].ch == '\0') {
 			end--;
 			break;
 		}
@@ -180,13 +185,14 @@ void tsm_screen_selection_word(struct tsm_screen *con,
 }
 
 /* calculates the line length from the beginning to the last non zero character */
-static unsigned int calc_line_len(struct line *line)
+static unsigned int calc_line_len(const struct line *line,
+				  const struct cell *cells)
 {
 	unsigned int line_len = 0;
 	int i;
 
 	for (i = 0; i < line->size; i++) {
-		if (line->cells[i].ch != 0) {
+		if (cells[i].ch != 0) {
 			line_len = i + 1;
 		}
 	}
@@ -194,17 +200,23 @@ static unsigned int calc_line_len(struct line *line)
 	return line_len;
 }
 
-/* TODO: tsm_ucs4_to_utf8 expects UCS4 characters, but a cell contains a
- * tsm-symbol (which can contain multiple UCS4 chars). Fix this when introducing
- * support for combining characters. */
-static unsigned int copy_line(struct line *line, char *buf,
-			      unsigned int start, unsigned int len)
+/* A cell holds a tsm-symbol, which expands to up to TSM_UCS4_MAXLEN UCS4
+ * characters when it carries combining marks. */
+static unsigned int copy_line(struct tsm_screen *con, struct line *line,
+			      char *buf, unsigned int start, unsigned int len)
 {
 	unsigned int i, end;
 	char *pos = buf;
 	int line_len;
+	const struct cell *cells;
+	const uint32_t *ucs4;
+	size_t j, ucs4_len;
+
+	cells = screen_line_cells(con, line);
+	if (!cells)
+		return 0;
 
-	line_len = calc_line_len(line);
+	line_len = calc_line_len(line, cells);
 	if (start > line_len) {
 		return 0;
 	}
@@ -216,10 +228,14 @@ static unsigned int copy_line(struct line *line, char *buf,
 	}
 
 	for (i = start; i < line->size && i < end; ++i) {
-		if (i < line->size || !line->cells[i].ch)
-			pos += tsm_ucs4_to_utf8(line->cells[i].ch, pos);
-		else
+		if (i < line->size || !cells[i].ch) {
+			ucs4 = tsm_symbol_get(con->sym_table, &cells[i].ch,
+					      &ucs4_len);
+			for (j = 0; j < ucs4_len; ++j)
+				pos += tsm_ucs4_to_utf8(ucs4[j], pos);
+		} else {
 			pos += tsm_ucs4_to_utf8(' ', pos);
+		}
 	}
 
 	pos += tsm_ucs4_to_utf8('\n', pos);
@@ -400,8 +416,8 @@ static int calc_selection_line_len(struct tsm_screen *con, struct selection_pos
  */
 static unsigned int calc_line_copy_buffer(struct tsm_screen *con, unsigned int num_lines)
 {
-	// 4 is the max size of a Unicode character
-	return con->size_x * num_lines * 4 + 1;
+	// 4 is the max size of a Unicode character, plus a newline per line
+	return (con->size_x * TSM_UCS4_MAXLEN * 4 + 1) * num_lines + 1;
 }
 
 /*
@@ -424,7 +440,7 @@ static int copy_lines_sb(struct tsm_screen *con, struct selection_pos *start, st
 		}
 
 		line_len = calc_selection_line_len_sb(con, start, end, iter);
-		pos += copy_line(iter, &(buf[pos]), line_x, line_len);
+		pos += copy_line(con, iter, &(buf[pos]), line_x, line_len);
 
 		if (iter == con->sb_last || iter == end->line) {
 			break;
@@ -456,7 +472,7 @@ static int copy_lines(struct tsm_screen *con, struct selection_pos *start, struc
 			line_x = start->x;
 		}
 
-		pos += copy_line(con->lines[i], &(buf[pos]), line_x, line_len);
+		pos += copy_line(con, con->lines[i], &(buf[pos]), line_x, line_len);
 	}
 
 	return pos;
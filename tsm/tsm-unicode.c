@@ -57,11 +57,14 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "wcwidth.h"
 #include "libtsm.h"
 #include "libtsm-int.h"
-#include "shl-array.h"
-#include "shl-htable.h"
 
 /*
  * Unicode Symbol Handling
@@ -83,13 +86,15 @@
  * a valid UCS4 value, though. But no memory management is needed as all
  * tsm_symbol_t objects are simple integers.
  *
- * The symbol table contains two-way
- * references. The Hash Table contains all the symbols with the symbol ucs4
- * string as key and the symbol ID as value.
- * The index array contains the symbol ID as key and a pointer to the ucs4
- * string as value. But the hash table owns the ucs4 string.
- * This allows fast implementations of *_get() and *_append() without long
- * search intervals.
+ * Combined symbols are numbered from TSM_UCS4_MAX + 1 upwards and the symbol
+ * minus that base indexes the entry array, so *_get() is a single array
+ * access. Each entry points to its ucs4 string, which lives in an append-only
+ * arena of fixed-size chunks so pointers handed out stay valid while the
+ * table grows. Entries also cache the string's hash and display width.
+ * For *_append() an open-addressed index (linear probing, kept at most half
+ * full and doubled when it is not) maps the hash to the entry. The hash of a
+ * string is derived from the hash of its prefix, so appending a mark never
+ * rehashes or copies the whole string just to look it up.
  *
  * When creating a new symbol, we simply return the UCS4 value as new symbol. We
  * do not add it to our symbol table as it is only one character. However, if a
@@ -99,53 +104,88 @@
 
 const tsm_symbol_t tsm_symbol_default = 0;
 
+#define SYMBOL_BASE (TSM_UCS4_MAX + 1)
+#define SYMBOL_CHUNK 4096
+
+struct symbol {
+	const uint32_t *ucs4;
+	uint32_t hash;
+	uint8_t len;
+	uint8_t width;
+};
+
+struct symbol_chunk {
+	struct symbol_chunk *next;
+	size_t used;
+	uint32_t data[SYMBOL_CHUNK];
+};
+
 struct tsm_symbol_table {
 	unsigned long ref;
-	uint32_t next_id;
-	struct shl_array *index;
-	struct shl_htable symbols;
+
+	struct symbol *symbols;		/* indexed by symbol - SYMBOL_BASE */
+	uint32_t symbol_num;
+	uint32_t symbol_size;
+
+	uint32_t *index;		/* open-addressed, entry index + 1 */
+	uint32_t index_size;		/* power of two */
+
+	struct symbol_chunk *arena;	/* newest chunk first */
 };
 
-static size_t hash_ucs4(const void *key, void *priv)
+/* djb2, computed one character at a time */
+static inline uint32_t hash_ucs4_step(uint32_t hash, uint32_t ucs4)
 {
-	size_t i, val = 5381;
-	const uint32_t *ucs4 = key;
+	return hash * 33 + ucs4;
+}
 
-	for (i = 0; ucs4[i] <= TSM_UCS4_MAX; ++i)
-		val = val * 33 + ucs4[i];
+static void symbol_index_insert(struct tsm_symbol_table *tbl, uint32_t idx)
+{
+	uint32_t mask = tbl->index_size - 1;
+	uint32_t i = tbl->symbols[idx].hash & mask;
 
-	return val;
+	while (tbl->index[i])
+		i = (i + 1) & mask;
+	tbl->index[i] = idx + 1;
 }
 
-static bool cmp_ucs4(const void *a, const void *b)
+static int symbol_index_rebuild(struct tsm_symbol_table *tbl, uint32_t size)
 {
-	size_t i;
-	const uint32_t *v1, *v2;
+	uint32_t *index, i;
 
-	v1 = a;
-	v2 = b;
+	index = calloc(size, sizeof(*index));
+	if (!index)
+		return -ENOMEM;
 
-	for (i = 0; ; ++i) {
-		if (v1[i] > TSM_UCS4_MAX && v2[i] > TSM_UCS4_MAX)
-			return true;
-		if (v1[i] != v2[i])
-			return false;
-	}
+	free(tbl->index);
+	tbl->index = index;
+	tbl->index_size = size;
+	for (i = 0; i < tbl->symbol_num; ++i)
+		symbol_index_insert(tbl, i);
+
+	return 0;
 }
 
-static void free_ucs4(void *elem, void *priv)
+static uint32_t *symbol_arena_alloc(struct tsm_symbol_table *tbl, size_t len)
 {
-	uint32_t *v = elem;
+	struct symbol_chunk *chunk = tbl->arena;
+
+	if (!chunk || chunk->used + len > SYMBOL_CHUNK) {
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+		chunk->next = tbl->arena;
+		chunk->used = 0;
+		tbl->arena = chunk;
+	}
 
-	/* key is prefix with actual value so pass correct pointer */
-	free(--v);
+	chunk->used += len;
+	return &chunk->data[chunk->used - len];
 }
 
 int tsm_symbol_table_new(struct tsm_symbol_table **out)
 {
 	struct tsm_symbol_table *tbl;
-	int ret;
-	static const uint32_t *val = NULL; /* we need a valid lvalue */
 
 	if (!out)
 		return -EINVAL;
@@ -155,22 +195,9 @@ int tsm_symbol_table_new(struct tsm_symbol_table **out)
 		return -ENOMEM;
 	memset(tbl, 0, sizeof(*tbl));
 	tbl->ref = 1;
-	tbl->next_id = TSM_UCS4_MAX + 2;
-	shl_htable_init(&tbl->symbols, cmp_ucs4, hash_ucs4, NULL);
-
-	ret = shl_array_new(&tbl->index, sizeof(uint32_t*), 4);
-	if (ret)
-		goto err_free;
-
-	/* first entry is not used so add dummy */
-	shl_array_push(tbl->index, &val);
 
 	*out = tbl;
 	return 0;
-
-err_free:
-	free(tbl);
-	return ret;
 }
 
 void tsm_symbol_table_ref(struct tsm_symbol_table *tbl)
@@ -183,11 +210,17 @@ void tsm_symbol_table_ref(struct tsm_symbol_table *tbl)
 
 void tsm_symbol_table_unref(struct tsm_symbol_table *tbl)
 {
+	struct symbol_chunk *chunk;
+
 	if (!tbl || !tbl->ref || --tbl->ref)
 		return;
 
-	shl_htable_clear(&tbl->symbols, free_ucs4, NULL);
-	shl_array_free(tbl->index);
+	while ((chunk = tbl->arena)) {
+		tbl->arena = chunk->next;
+		free(chunk);
+	}
+	free(tbl->index);
+	free(tbl->symbols);
 	free(tbl);
 }
 
@@ -205,15 +238,15 @@ tsm_symbol_t tsm_symbol_make(uint32_t ucs4)
  * Therefore, the returned value may get destroyed if your \sym argument gets
  * destroyed.
  * If \sym is a composed ucs4 string, then the returned value points into the
- * hash table of the symbol table and lives as long as the symbol table does.
+ * arena of the symbol table and lives as long as the symbol table does.
  *
  * This always returns a valid value. If an error happens, the default character
  * is returned. If \size is NULL, then the size value is omitted.
  */
 const uint32_t *tsm_symbol_get(struct tsm_symbol_table *tbl,
-			       tsm_symbol_t *sym, size_t *size)
+			       const tsm_symbol_t *sym, size_t *size)
 {
-	uint32_t *ucs4, idx;
+	uint32_t idx;
 
 	if (*sym <= TSM_UCS4_MAX) {
 		if (size)
@@ -224,35 +257,26 @@ const uint32_t *tsm_symbol_get(struct tsm_symbol_table *tbl,
 	if (!tbl)
 		return sym;
 
-	idx = *sym - (TSM_UCS4_MAX + 1);
-	if (idx >= shl_array_get_length(tbl->index))
-		ucs4 = NULL;
-	else
-		ucs4 = *SHL_ARRAY_AT(tbl->index, uint32_t*, idx);
-
-	if (!ucs4) {
+	idx = *sym - SYMBOL_BASE;
+	if (idx >= tbl->symbol_num) {
 		if (size)
 			*size = 1;
 		return &tsm_symbol_default;
 	}
 
-	if (size) {
-		*size = 0;
-		while (ucs4[*size] <= TSM_UCS4_MAX)
-			++*size;
-	}
-
-	return ucs4;
+	if (size)
+		*size = tbl->symbols[idx].len;
+	return tbl->symbols[idx].ucs4;
 }
 
 tsm_symbol_t tsm_symbol_append(struct tsm_symbol_table *tbl,
 			       tsm_symbol_t sym, uint32_t ucs4)
 {
-	uint32_t buf[TSM_UCS4_MAXLEN + 1], nsym, *nval;
 	const uint32_t *ptr;
+	const struct symbol *e;
+	struct symbol *symbols;
+	uint32_t hash, mask, i, idx, size, *str;
 	size_t s;
-	bool res;
-	int ret;
 
 	if (!tbl)
 		return sym;
@@ -264,67 +288,79 @@ tsm_symbol_t tsm_symbol_append(struct tsm_symbol_table *tbl,
 	if (s >= TSM_UCS4_MAXLEN)
 		return sym;
 
-	memcpy(buf, ptr, s * sizeof(uint32_t));
-	buf[s++] = ucs4;
-	buf[s++] = TSM_UCS4_MAX + 1;
-
-	res = shl_htable_lookup(&tbl->symbols, buf, hash_ucs4(buf, NULL),
-				(void**)&nval);
-	if (res) {
-		/* key is prefixed with actual value */
-		return *--nval;
+	/* combined symbols are at least two characters long, everything
+	 * else (including unknown IDs) decomposes into a single one */
+	if (s > 1)
+		hash = tbl->symbols[sym - SYMBOL_BASE].hash;
+	else
+		hash = hash_ucs4_step(5381, *ptr);
+	hash = hash_ucs4_step(hash, ucs4);
+
+	if (tbl->index_size) {
+		mask = tbl->index_size - 1;
+		for (i = hash & mask; tbl->index[i]; i = (i + 1) & mask) {
+			e = &tbl->symbols[tbl->index[i] - 1];
+			if (e->hash == hash && e->len == s + 1 &&
+			    e->ucs4[s] == ucs4 &&
+			    !memcmp(e->ucs4, ptr, s * sizeof(uint32_t)))
+				return SYMBOL_BASE + tbl->index[i] - 1;
+		}
 	}
 
-	/* We save the key in nval and prefix it with the new ID. Note that
-	 * the prefix is hidden, we actually store "++nval" in the htable. */
-	nval = malloc(sizeof(uint32_t) * (s + 1));
-	if (!nval)
-		return sym;
-
-	++nval;
-	memcpy(nval, buf, s * sizeof(uint32_t));
-
-	nsym = tbl->next_id + 1;
 	/* Out of IDs; we actually have 2 Billion IDs so this seems
 	 * very unlikely but lets be safe here */
-	if (nsym <= tbl->next_id++)
-		goto err_id;
+	if (tbl->symbol_num >= UINT32_MAX - SYMBOL_BASE)
+		return sym;
 
-	/* store ID hidden before the key */
-	*(nval - 1) = nsym;
+	if (tbl->symbol_num >= tbl->symbol_size) {
+		size = tbl->symbol_size ? tbl->symbol_size * 2 : 64;
+		symbols = realloc(tbl->symbols, size * sizeof(*symbols));
+		if (!symbols)
+			return sym;
+		tbl->symbols = symbols;
+		tbl->symbol_size = size;
+	}
 
-	ret = shl_htable_insert(&tbl->symbols, nval, hash_ucs4(nval, NULL));
-	if (ret)
-		goto err_id;
+	/* keep the index at most half full */
+	if ((tbl->symbol_num + 1) * 2 > tbl->index_size) {
+		size = tbl->index_size ? tbl->index_size * 2 : 128;
+		if (symbol_index_rebuild(tbl, size))
+			return sym;
+	}
 
-	ret = shl_array_push(tbl->index, &nval);
-	if (ret)
-		goto err_symbol;
+	str = symbol_arena_alloc(tbl, s + 1);
+	if (!str)
+		return sym;
+	memcpy(str, ptr, s * sizeof(uint32_t));
+	str[s] = ucs4;
 
-	return nsym;
+	idx = tbl->symbol_num++;
+	tbl->symbols[idx].ucs4 = str;
+	tbl->symbols[idx].hash = hash;
+	tbl->symbols[idx].len = s + 1;
+	tbl->symbols[idx].width = tsm_ucs4_get_width(str[0]);
+	symbol_index_insert(tbl, idx);
 
-err_symbol:
-	shl_htable_remove(&tbl->symbols, nval, hash_ucs4(nval, NULL), NULL);
-err_id:
-	--tbl->next_id;
-	free(nval);
-	return sym;
+	return SYMBOL_BASE + idx;
 }
 
 unsigned int tsm_symbol_get_width(struct tsm_symbol_table *tbl,
 				  tsm_symbol_t sym)
 {
-	const uint32_t *ch;
-	size_t len;
+	uint32_t idx;
 
 	if (!tbl)
 		return 0;
 
-	ch = tsm_symbol_get(tbl, &sym, &len);
-	if (len == 0)
-		return 0;
+	if (sym <= TSM_UCS4_MAX)
+		return tsm_ucs4_get_width(sym);
 
-	return tsm_ucs4_get_width(*ch);
+	/* combined symbols take the width of their base character */
+	idx = sym - SYMBOL_BASE;
+	if (idx >= tbl->symbol_num)
+		return tsm_ucs4_get_width(tsm_symbol_default);
+
+	return tbl->symbols[idx].width;
 }
 
 SHL_EXPORT
@@ -339,6 +375,29 @@ unsigned int tsm_ucs4_get_width(uint32_t ucs4)
 	return ret;
 }
 
+/*
+ * Batch version of tsm_ucs4_get_width(). Writes the width of each of the @len
+ * characters in @ucs4 into @widths (if not NULL) and returns their sum.
+ */
+SHL_EXPORT
+size_t tsm_ucs4_get_widths(const uint32_t *ucs4, size_t len, uint8_t *widths)
+{
+	size_t i, sum = 0;
+	unsigned int w;
+
+	for (i = 0; i < len; ++i) {
+		if (ucs4[i] >= 0x20 && ucs4[i] < 0x7f)
+			w = 1;
+		else
+			w = tsm_ucs4_get_width(ucs4[i]);
+		if (widths)
+			widths[i] = w;
+		sum += w;
+	}
+
+	return sum;
+}
+
 /*
  * Convert UCS4 character to UTF-8. This creates one of:
  *   0xxxxxxx
@@ -443,6 +502,11 @@ char *tsm_ucs4_to_utf8_alloc(const uint32_t *ucs4, size_t len, size_t *len_out)
  * tsm_utf8_mach_get(): Returns the last parsed character. It has no effect on
  * the state machine so you can call it multiple times.
  *
+ * tsm_utf8_mach_decode(): Bulk version of the two above. Converts a whole
+ * buffer into UCS4 values with exactly the same results as feeding it byte by
+ * byte, but decodes ASCII blocks with SIMD and well-formed sequences without
+ * going through the state machine.
+ *
  * Internally, we use TSM_UTF8_START whenever the state-machine is reset. This
  * can be used to ignore the last read input or to simply reset the machine.
  * TSM_UTF8_EXPECT* is used to remember how many bytes are still to be read to
@@ -463,11 +527,6 @@ char *tsm_ucs4_to_utf8_alloc(const uint32_t *ucs4, size_t len, size_t *len_out)
  * so we avoid any non-ASCII+non-UTF8 input to prevent this.
  */
 
-struct tsm_utf8_mach {
-	int state;
-	uint32_t ch;
-};
-
 int tsm_utf8_mach_new(struct tsm_utf8_mach **out)
 {
 	struct tsm_utf8_mach *mach;
@@ -578,3 +637,167 @@ void tsm_utf8_mach_reset(struct tsm_utf8_mach *mach)
 
 	mach->state = TSM_UTF8_START;
 }
+
+/* true if the machine is not in the middle of a multi-byte sequence */
+bool tsm_utf8_mach_idle(struct tsm_utf8_mach *mach)
+{
+	return !mach || mach->state == TSM_UTF8_START ||
+	       mach->state == TSM_UTF8_ACCEPT ||
+	       mach->state == TSM_UTF8_REJECT;
+}
+
+/*
+ * Widen pure-ASCII blocks straight into @out. Returns the number of bytes
+ * converted, which is a multiple of the vector width and stops at the first
+ * block containing a byte >= 0x80.
+ */
+static size_t utf8_decode_ascii(const unsigned char *in, size_t len,
+				uint32_t *out)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	while (i + 32 <= len) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&in[i]);
+		if (_mm256_movemask_epi8(v))
+			break;
+		_mm256_storeu_si256((__m256i *)&out[i],
+			_mm256_cvtepu8_epi32(_mm256_castsi256_si128(v)));
+		_mm256_storeu_si256((__m256i *)&out[i + 8],
+			_mm256_cvtepu8_epi32(_mm_srli_si128(
+				_mm256_castsi256_si128(v), 8)));
+		_mm256_storeu_si256((__m256i *)&out[i + 16],
+			_mm256_cvtepu8_epi32(_mm256_extracti128_si256(v, 1)));
+		_mm256_storeu_si256((__m256i *)&out[i + 24],
+			_mm256_cvtepu8_epi32(_mm_srli_si128(
+				_mm256_extracti128_si256(v, 1), 8)));
+		i += 32;
+	}
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	while (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+		if (_mm_movemask_epi8(v))
+			break;
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i *)&out[i],
+				 _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *)&out[i + 4],
+				 _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *)&out[i + 8],
+				 _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i *)&out[i + 12],
+				 _mm_unpackhi_epi16(hi, zero));
+		i += 16;
+	}
+#else
+	uint64_t w;
+
+	while (i + 8 <= len) {
+		memcpy(&w, &in[i], sizeof(w));
+		if (w & 0x8080808080808080ULL)
+			break;
+		for (unsigned int k = 0; k < 8; ++k)
+			out[i + k] = in[i + k];
+		i += 8;
+	}
+#endif
+
+	return i;
+}
+
+/*
+ * Decode up to *out_len characters from @in into @out and return the number
+ * of bytes consumed; *out_len is set to the number of characters written.
+ *
+ * The output is identical to feeding every byte into tsm_utf8_mach_feed() and
+ * collecting tsm_utf8_mach_get() on TSM_UTF8_ACCEPT/REJECT, including the
+ * replacement characters for malformed input. Sequences cut off by the end
+ * of @in are carried in @mach: they stay unconsumed as long as something was
+ * decoded (so the caller can act on the output first) and are fed into @mach
+ * once they are all that is left.
+ */
+size_t tsm_utf8_mach_decode(struct tsm_utf8_mach *mach, const char *in,
+			    size_t len, uint32_t *out, size_t *out_len)
+{
+	const unsigned char *p = (const unsigned char *)in;
+	size_t i = 0, n = 0, max, k, need;
+	uint32_t c, ch;
+	int state;
+
+	if (!mach || !in || !out || !out_len)
+		return 0;
+
+	max = *out_len;
+	while (i < len && n < max) {
+		if (!tsm_utf8_mach_idle(mach)) {
+			/* finish a sequence carried over from earlier input */
+			state = tsm_utf8_mach_feed(mach, (char)p[i++]);
+			if (state == TSM_UTF8_ACCEPT ||
+			    state == TSM_UTF8_REJECT)
+				out[n++] = tsm_utf8_mach_get(mach);
+			continue;
+		}
+
+		k = len - i;
+		if (k > max - n)
+			k = max - n;
+		k = utf8_decode_ascii(&p[i], k, &out[n]);
+		i += k;
+		n += k;
+		if (i >= len || n >= max)
+			break;
+
+		c = p[i];
+		if (c < 0x80) {
+			out[n++] = c;
+			++i;
+			continue;
+		}
+
+		if ((c & 0xE0) == 0xC0) {
+			need = 1;
+			ch = c & 0x1F;
+		} else if ((c & 0xF0) == 0xE0) {
+			need = 2;
+			ch = c & 0x0F;
+		} else if ((c & 0xF8) == 0xF0) {
+			need = 3;
+			ch = c & 0x07;
+		} else {
+			need = 0;
+			ch = 0;
+		}
+
+		if (need) {
+			for (k = 1; k <= need && i + k < len; ++k) {
+				if ((p[i + k] & 0xC0) != 0x80)
+					break;
+				ch = (ch << 6) | (p[i + k] & 0x3F);
+			}
+
+			if (k > need) {
+				/* well-formed sequence */
+				out[n++] = ch;
+				i += need + 1;
+				mach->state = TSM_UTF8_ACCEPT;
+				mach->ch = ch;
+				continue;
+			}
+
+			if (i + k >= len && n)
+				/* truncated by the end of the input */
+				break;
+		}
+
+		/* malformed or truncated input, let the machine decide */
+		state = tsm_utf8_mach_feed(mach, (char)p[i++]);
+		if (state == TSM_UTF8_ACCEPT || state == TSM_UTF8_REJECT)
+			out[n++] = tsm_utf8_mach_get(mach);
+	}
+
+	*out_len = n;
+	return i;
+}
@@ -47,6 +47,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -455,6 +456,10 @@ static void copy_bcolor(struct tsm_screen_attr *dest,
 	dest->bb = src->bb;
 }
 
+/* parser table, see "Escape sequence parser" below */
+static pthread_once_t vte_table_once = PTHREAD_ONCE_INIT;
+static void vte_table_init(void);
+
 SHL_EXPORT
 int tsm_vte_new(struct tsm_vte **out, struct tsm_screen *con,
 		tsm_vte_write_cb write_cb, void *data,
@@ -466,6 +471,10 @@ int tsm_vte_new(struct tsm_vte **out, struct tsm_screen *con,
 	if (!out || !con || !write_cb)
 		return -EINVAL;
 
+	ret = pthread_once(&vte_table_once, vte_table_init);
+	if (ret)
+		return -ret;
+
 	vte = malloc(sizeof(*vte));
 	if (!vte)
 		return -ENOMEM;
@@ -2258,388 +2267,305 @@ static void do_trans(struct tsm_vte *vte, uint32_t data, int state, int act)
 		 * transition to the same state as the current state we do this.
 		 * Use STATE_NONE if this is not the desired behavior.
 		 */
-		do_action(vte, data, exit_action[vte->state]);
-		do_action(vte, data, act);
-		do_action(vte, data, entry_action[state]);
+		if (exit_action[vte->state] != ACTION_NONE)
+			do_action(vte, data, exit_action[vte->state]);
+		if (act != ACTION_NONE)
+			do_action(vte, data, act);
+		if (entry_action[state] != ACTION_NONE)
+			do_action(vte, data, entry_action[state]);
 		vte->state = state;
-	} else {
+	} else if (act != ACTION_NONE) {
 		do_action(vte, data, act);
 	}
 }
 
 /*
  * Escape sequence parser
+ * The DEC/ANSI parser is a dense [state][input class] table. Every entry
+ * holds the next state (STATE_NONE if there is no transition) in the upper
+ * and the transition action in the lower four bits. Input classes are the
+ * values 0x00-0x9f themselves plus one class for everything from 0xa0 up,
+ * which no state treats differently.
+ *
+ * The table is built once from the rules below, in the order default, state
+ * specific, anywhere; later rules override earlier ones. tsm_vte_new() builds
+ * it under pthread_once(), so VTEs on different threads never see it half
+ * filled.
+ */
+
+#define VTE_CLASS_NUM 0xa1
+#define VTE_TRANS(state, act) ((uint8_t)((state) << 4 | (act)))
+
+_Static_assert(STATE_NUM <= 16 && ACTION_NUM <= 16,
+	       "parser states and actions must fit in 4 bits each");
+
+static uint8_t vte_table[STATE_NUM][VTE_CLASS_NUM];
+
+static void table_set(int state, uint32_t from, uint32_t to, int next, int act)
+{
+	uint32_t i;
+
+	for (i = from; i <= to && i < VTE_CLASS_NUM; ++i)
+		vte_table[state][i] = VTE_TRANS(next, act);
+}
+
+/* C0 controls which are executed (or ignored) in place by most states */
+static void table_set_c0(int state, int act)
+{
+	table_set(state, 0x00, 0x17, STATE_NONE, act);
+	table_set(state, 0x19, 0x19, STATE_NONE, act);
+	table_set(state, 0x1c, 0x1f, STATE_NONE, act);
+}
+
+static void vte_table_init(void)
+{
+	int s;
+
+	s = STATE_GROUND;
+	table_set(s, 0x00, 0xa0, STATE_NONE, ACTION_PRINT);
+	table_set_c0(s, ACTION_EXECUTE);
+	table_set(s, 0x80, 0x8f, STATE_NONE, ACTION_EXECUTE);
+	table_set(s, 0x91, 0x9a, STATE_NONE, ACTION_EXECUTE);
+	table_set(s, 0x9c, 0x9c, STATE_NONE, ACTION_EXECUTE);
+
+	s = STATE_ESC;
+	table_set(s, 0x00, 0xa0, STATE_ESC_INT, ACTION_COLLECT);
+	table_set_c0(s, ACTION_EXECUTE);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+	table_set(s, 0x20, 0x2f, STATE_ESC_INT, ACTION_COLLECT);
+	table_set(s, 0x30, 0x4f, STATE_GROUND, ACTION_ESC_DISPATCH);
+	table_set(s, 0x51, 0x57, STATE_GROUND, ACTION_ESC_DISPATCH);
+	table_set(s, 0x59, 0x5a, STATE_GROUND, ACTION_ESC_DISPATCH);
+	table_set(s, 0x5c, 0x5c, STATE_GROUND, ACTION_ESC_DISPATCH);
+	table_set(s, 0x60, 0x7e, STATE_GROUND, ACTION_ESC_DISPATCH);
+	table_set(s, 0x5b, 0x5b, STATE_CSI_ENTRY, ACTION_NONE);
+	table_set(s, 0x5d, 0x5d, STATE_OSC_STRING, ACTION_NONE);
+	table_set(s, 0x50, 0x50, STATE_DCS_ENTRY, ACTION_NONE);
+	table_set(s, 0x58, 0x58, STATE_ST_IGNORE, ACTION_NONE);
+	table_set(s, 0x5e, 0x5f, STATE_ST_IGNORE, ACTION_NONE);
+
+	s = STATE_ESC_INT;
+	table_set(s, 0x00, 0xa0, STATE_NONE, ACTION_COLLECT);
+	table_set_c0(s, ACTION_EXECUTE);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+	table_set(s, 0x30, 0x7e, STATE_GROUND, ACTION_ESC_DISPATCH);
+
+	s = STATE_CSI_ENTRY;
+	table_set(s, 0x00, 0xa0, STATE_CSI_IGNORE, ACTION_NONE);
+	table_set_c0(s, ACTION_EXECUTE);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+	table_set(s, 0x20, 0x2f, STATE_CSI_INT, ACTION_COLLECT);
+	table_set(s, 0x30, 0x39, STATE_CSI_PARAM, ACTION_PARAM);
+	table_set(s, 0x3b, 0x3b, STATE_CSI_PARAM, ACTION_PARAM);
+	table_set(s, 0x3c, 0x3f, STATE_CSI_PARAM, ACTION_COLLECT);
+	table_set(s, 0x40, 0x7e, STATE_GROUND, ACTION_CSI_DISPATCH);
+
+	s = STATE_CSI_PARAM;
+	table_set(s, 0x00, 0xa0, STATE_CSI_IGNORE, ACTION_NONE);
+	table_set_c0(s, ACTION_EXECUTE);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+	table_set(s, 0x30, 0x39, STATE_NONE, ACTION_PARAM);
+	table_set(s, 0x3b, 0x3b, STATE_NONE, ACTION_PARAM);
+	table_set(s, 0x20, 0x2f, STATE_CSI_INT, ACTION_COLLECT);
+	table_set(s, 0x40, 0x7e, STATE_GROUND, ACTION_CSI_DISPATCH);
+
+	s = STATE_CSI_INT;
+	table_set(s, 0x00, 0xa0, STATE_CSI_IGNORE, ACTION_NONE);
+	table_set_c0(s, ACTION_EXECUTE);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+	table_set(s, 0x20, 0x2f, STATE_NONE, ACTION_COLLECT);
+	table_set(s, 0x40, 0x7e, STATE_GROUND, ACTION_CSI_DISPATCH);
+
+	s = STATE_CSI_IGNORE;
+	table_set(s, 0x00, 0xa0, STATE_NONE, ACTION_IGNORE);
+	table_set_c0(s, ACTION_EXECUTE);
+	table_set(s, 0x40, 0x7e, STATE_GROUND, ACTION_NONE);
+
+	s = STATE_DCS_ENTRY;
+	table_set(s, 0x00, 0xa0, STATE_DCS_PASS, ACTION_NONE);
+	table_set_c0(s, ACTION_IGNORE);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+	table_set(s, 0x3a, 0x3a, STATE_DCS_IGNORE, ACTION_NONE);
+	table_set(s, 0x20, 0x2f, STATE_DCS_INT, ACTION_COLLECT);
+	table_set(s, 0x30, 0x39, STATE_DCS_PARAM, ACTION_PARAM);
+	table_set(s, 0x3b, 0x3b, STATE_DCS_PARAM, ACTION_PARAM);
+	table_set(s, 0x3c, 0x3f, STATE_DCS_PARAM, ACTION_COLLECT);
+
+	s = STATE_DCS_PARAM;
+	table_set(s, 0x00, 0xa0, STATE_DCS_PASS, ACTION_NONE);
+	table_set_c0(s, ACTION_IGNORE);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+	table_set(s, 0x30, 0x39, STATE_NONE, ACTION_PARAM);
+	table_set(s, 0x3b, 0x3b, STATE_NONE, ACTION_PARAM);
+	table_set(s, 0x3a, 0x3a, STATE_DCS_IGNORE, ACTION_NONE);
+	table_set(s, 0x3c, 0x3f, STATE_DCS_IGNORE, ACTION_NONE);
+	table_set(s, 0x20, 0x2f, STATE_DCS_INT, ACTION_COLLECT);
+
+	s = STATE_DCS_INT;
+	table_set(s, 0x00, 0xa0, STATE_DCS_PASS, ACTION_NONE);
+	table_set_c0(s, ACTION_IGNORE);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+	table_set(s, 0x20, 0x2f, STATE_NONE, ACTION_COLLECT);
+	table_set(s, 0x30, 0x3f, STATE_DCS_IGNORE, ACTION_NONE);
+
+	s = STATE_DCS_PASS;
+	table_set(s, 0x00, 0xa0, STATE_NONE, ACTION_DCS_COLLECT);
+	table_set(s, 0x7f, 0x7f, STATE_NONE, ACTION_IGNORE);
+
+	s = STATE_DCS_IGNORE;
+	table_set(s, 0x00, 0xa0, STATE_NONE, ACTION_IGNORE);
+
+	s = STATE_OSC_STRING;
+	table_set(s, 0x00, 0xa0, STATE_NONE, ACTION_OSC_COLLECT);
+	table_set_c0(s, ACTION_IGNORE);
+	table_set(s, 0x07, 0x07, STATE_GROUND, ACTION_NONE);
+
+	s = STATE_ST_IGNORE;
+	table_set(s, 0x00, 0xa0, STATE_NONE, ACTION_IGNORE);
+
+	/* events that may occur in any state */
+	for (s = STATE_GROUND; s < STATE_NUM; ++s) {
+		table_set(s, 0x18, 0x18, STATE_GROUND, ACTION_EXECUTE);
+		table_set(s, 0x1a, 0x1a, STATE_GROUND, ACTION_EXECUTE);
+		table_set(s, 0x80, 0x8f, STATE_GROUND, ACTION_EXECUTE);
+		table_set(s, 0x91, 0x97, STATE_GROUND, ACTION_EXECUTE);
+		table_set(s, 0x99, 0x9a, STATE_GROUND, ACTION_EXECUTE);
+		table_set(s, 0x9c, 0x9c, STATE_GROUND, ACTION_EXECUTE);
+		table_set(s, 0x1b, 0x1b, STATE_ESC, ACTION_NONE);
+		table_set(s, 0x98, 0x98, STATE_ST_IGNORE, ACTION_NONE);
+		table_set(s, 0x9e, 0x9f, STATE_ST_IGNORE, ACTION_NONE);
+		table_set(s, 0x90, 0x90, STATE_DCS_ENTRY, ACTION_NONE);
+		table_set(s, 0x9d, 0x9d, STATE_OSC_STRING, ACTION_NONE);
+		table_set(s, 0x9b, 0x9b, STATE_CSI_ENTRY, ACTION_NONE);
+	}
+}
+
+/*
  * This parses the new input character \data. It performs state transition and
  * calls the right callbacks for each action.
  */
-static void parse_data(struct tsm_vte *vte, uint32_t raw)
+static inline void parse_data(struct tsm_vte *vte, uint32_t raw)
 {
-	/* events that may occur in any state */
-	switch (raw) {
-		case 0x18:
-		case 0x1a:
-		case 0x80 ... 0x8f:
-		case 0x91 ... 0x97:
-		case 0x99:
-		case 0x9a:
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_EXECUTE);
-			return;
-		case 0x1b:
-			do_trans(vte, raw, STATE_ESC, ACTION_NONE);
-			return;
-		case 0x98:
-		case 0x9e:
-		case 0x9f:
-			do_trans(vte, raw, STATE_ST_IGNORE, ACTION_NONE);
-			return;
-		case 0x90:
-			do_trans(vte, raw, STATE_DCS_ENTRY, ACTION_NONE);
-			return;
-		case 0x9d:
-			do_trans(vte, raw, STATE_OSC_STRING, ACTION_NONE);
-			return;
-		case 0x9b:
-			do_trans(vte, raw, STATE_CSI_ENTRY, ACTION_NONE);
-			return;
+	uint8_t t;
+
+	t = vte_table[vte->state][raw < VTE_CLASS_NUM - 1 ?
+				  raw : VTE_CLASS_NUM - 1];
+	do_trans(vte, raw, t >> 4, t & 0xf);
+}
+/*
+ * Plain text fast path. In GROUND state printable characters (everything but
+ * C0/C1 controls and DEL) always result in ACTION_PRINT without any state
+ * transition, so runs of them can skip the parser. The values are still
+ * mapped through GL/GR so charset switches keep working, then measured in
+ * one tsm_ucs4_get_widths() call: single-width symbols go to the screen in
+ * one tsm_screen_write_run() call per stretch, anything else (wide
+ * characters, combining marks) through write_console().
+ * Returns the number of values consumed, 0 if ucs4[0] is not printable.
+ */
+static size_t print_run(struct tsm_vte *vte, const uint32_t *ucs4, size_t len)
+{
+	tsm_symbol_t run[256];
+	uint8_t widths[256];
+	size_t i, j, k, n;
+	bool ascii = true;
+
+	for (i = 0; i < len && i < sizeof(run) / sizeof(*run); ++i) {
+		if (ucs4[i] < 0x20 || (ucs4[i] >= 0x7f && ucs4[i] < 0xa0))
+			break;
+		run[i] = tsm_symbol_make(vte_map(vte, ucs4[i]));
+		if (run[i] >= 0x7f)
+			ascii = false;
 	}
 
-	/* events that depend on the current state */
-	switch (vte->state) {
-	case STATE_GROUND:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x80 ... 0x8f:
-		case 0x91 ... 0x9a:
-		case 0x9c:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_PRINT);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_PRINT);
-		return;
-	case STATE_ESC:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_ESC_INT, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x4f:
-		case 0x51 ... 0x57:
-		case 0x59:
-		case 0x5a:
-		case 0x5c:
-		case 0x60 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_ESC_DISPATCH);
-			return;
-		case 0x5b:
-			do_trans(vte, raw, STATE_CSI_ENTRY, ACTION_NONE);
-			return;
-		case 0x5d:
-			do_trans(vte, raw, STATE_OSC_STRING, ACTION_NONE);
-			return;
-		case 0x50:
-			do_trans(vte, raw, STATE_DCS_ENTRY, ACTION_NONE);
-			return;
-		case 0x58:
-		case 0x5e:
-		case 0x5f:
-			do_trans(vte, raw, STATE_ST_IGNORE, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_ESC_INT, ACTION_COLLECT);
-		return;
-	case STATE_ESC_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_ESC_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-		return;
-	case STATE_CSI_ENTRY:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_CSI_INT, ACTION_COLLECT);
-			return;
-		case 0x3a:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_CSI_PARAM, ACTION_PARAM);
-			return;
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_PARAM, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_PARAM:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_NONE, ACTION_PARAM);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x3a:
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_CSI_INT, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x3f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-		return;
-	case STATE_DCS_ENTRY:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x3a:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_DCS_INT, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_DCS_PARAM, ACTION_PARAM);
-			return;
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_PARAM, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_PARAM:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_NONE, ACTION_PARAM);
-			return;
-		case 0x3a:
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_DCS_INT, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_PASS:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7e:
-			do_trans(vte, raw, STATE_NONE, ACTION_DCS_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_DCS_COLLECT);
-		return;
-	case STATE_DCS_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-		return;
-	case STATE_OSC_STRING:
-		switch (raw) {
-		case 0x00 ... 0x06:
-		case 0x08 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_OSC_COLLECT);
-			return;
-		case 0x07:
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
+	n = i;
+	if (!n)
+		return 0;
+
+	to_rgb(vte, &vte->cattr);
+	if (ascii) {
+		tsm_screen_write_run(vte->con, run, n, &vte->cattr);
+		return n;
+	}
+
+	tsm_ucs4_get_widths(run, n, widths);
+	for (j = 0; j < n; j = k) {
+		for (k = j; k < n && widths[k] == 1; ++k)
+			;
+		if (k > j) {
+			tsm_screen_write_run(vte->con, &run[j], k - j,
+					     &vte->cattr);
+		} else {
+			tsm_screen_write(vte->con, run[j], &vte->cattr);
+			++k;
 		}
-		do_trans(vte, raw, STATE_NONE, ACTION_OSC_COLLECT);
-		return;
-	case STATE_ST_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
+	}
+
+	return n;
+}
+
+/*
+ * Feed decoded UCS4 values into the parser. Stops early if the input switched
+ * the VTE out of UTF-8 mode (DECSCL), as the rest of the block was decoded
+ * under the wrong assumption. Returns the number of values consumed.
+ */
+static size_t parse_ucs4(struct tsm_vte *vte, const uint32_t *ucs4, size_t len)
+{
+	size_t i = 0, n;
+
+	while (i < len) {
+		if (vte->state == STATE_GROUND) {
+			n = print_run(vte, &ucs4[i], len - i);
+			if (n) {
+				i += n;
+				continue;
+			}
 		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-		return;
+
+		parse_data(vte, ucs4[i++]);
+		if (vte->flags & (TSM_VTE_FLAG_7BIT_MODE |
+				  TSM_VTE_FLAG_8BIT_MODE))
+			break;
 	}
 
-	llog_warning(vte, "unhandled input %u in state %d", raw, vte->state);
+	return i;
 }
 
 SHL_EXPORT
 void tsm_vte_input(struct tsm_vte *vte, const char *u8, size_t len)
 {
-	int state;
-	uint32_t ucs4;
-	size_t i;
+	uint32_t ucs4[1024];
+	struct tsm_utf8_mach saved;
+	size_t i, n, used, used_n;
 
 	if (!vte || !vte->con)
 		return;
 
 	++vte->parse_cnt;
-	for (i = 0; i < len; ++i) {
+	for (i = 0; i < len; ) {
 		if (vte->flags & TSM_VTE_FLAG_7BIT_MODE) {
 			if (u8[i] & 0x80)
 				llog_debug(vte, "receiving 8bit character U+%d from pty while in 7bit mode",
 					   (int)u8[i]);
 			parse_data(vte, u8[i] & 0x7f);
+			++i;
 		} else if (vte->flags & TSM_VTE_FLAG_8BIT_MODE) {
 			parse_data(vte, u8[i]);
+			++i;
 		} else {
-			state = tsm_utf8_mach_feed(vte->mach, u8[i]);
-			if (state == TSM_UTF8_ACCEPT ||
-			    state == TSM_UTF8_REJECT) {
-				ucs4 = tsm_utf8_mach_get(vte->mach);
-				parse_data(vte, ucs4);
+			saved = *vte->mach;
+			n = sizeof(ucs4) / sizeof(*ucs4);
+			used = tsm_utf8_mach_decode(vte->mach, &u8[i], len - i,
+						    ucs4, &n);
+			used_n = parse_ucs4(vte, ucs4, n);
+			if (used_n < n) {
+				/* mode switch in the middle of the block,
+				 * find out how many bytes were really used */
+				*vte->mach = saved;
+				used = tsm_utf8_mach_decode(vte->mach, &u8[i],
+							    len - i, ucs4,
+							    &used_n);
 			}
+			i += used;
 		}
 	}
 	--vte->parse_cnt;
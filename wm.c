@@ -11,6 +11,7 @@
 #include <X11/extensions/Xinerama.h>
 
 #include "fonts/chicago12.h"
+#include "kdraw.h"
 
 static Atom wm_change_state;
 static Atom wm_state;
@@ -108,42 +109,11 @@ static void set_wm_state(Window w, long state) {
 
 /* Text rendering (same as bar.c) */
 static void draw_rect(uint32_t *buf, int buf_w, int buf_h, int x, int y, int w, int h, uint32_t c) {
-    for (int row = 0; row < h; row++) {
-        for (int col = 0; col < w; col++) {
-            int px = x + col;
-            int py = y + row;
-            if (px >= 0 && px < buf_w && py >= 0 && py < buf_h) {
-                buf[py * buf_w + px] = c;
-            }
-        }
-    }
-}
-
-static void draw_icn(uint32_t *buf, int buf_w, int buf_h, char *sprite, int x, int y, int scale, uint32_t color) {
-    for (int dy = 0; dy < 8; dy++) {
-        for (int dx = 0; dx < 8; dx++) {
-            if (*(sprite + dy) << dx & 0x80) {
-                draw_rect(buf, buf_w, buf_h, x + dx * scale, y + dy * scale, scale, scale, color);
-            }
-        }
-    }
+    kd_fill_rect(buf, buf_w, buf_h, x, y, w, h, c);
 }
 
 static void draw_text(uint32_t *buf, int buf_w, int buf_h, unsigned char *font, int x, int y, char *s, int scale, uint32_t c) {
-    while (*s) {
-        char chr = *s++;
-        int size = font[(unsigned char)chr];
-        if (chr > 32) {
-            char *sprite = (char *)&font[(unsigned char)chr * 8 * 4 + 256];
-            draw_icn(buf, buf_w, buf_h, sprite, x, y, scale, c);
-            draw_icn(buf, buf_w, buf_h, sprite + 8, x, y + 8 * scale, scale, c);
-            if (size > 8) {
-                draw_icn(buf, buf_w, buf_h, sprite + 16, x + 8 * scale, y, scale, c);
-                draw_icn(buf, buf_w, buf_h, sprite + 24, x + 8 * scale, y + 8 * scale, scale, c);
-            }
-        }
-        x = x + size * scale;
-    }
+    kd_text(buf, buf_w, buf_h, font, x, y, s, scale, c);
 }
 
 static int text_width(unsigned char *font, char *s, int scale) {